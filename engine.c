@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include "engine.h"
+#include "input.h"
+
+static const uint64_t start_drop_interval=600000L; // microseconds between drops
+static const uint64_t delta_drop_interval=30000L; // increment in drop rate
+static const uint64_t min_drop_interval=30000L; // fastest drop interval
+static const uint64_t game_over_pause=5000000L; // how long a lost game stays up
+
+static void copy_random_tetromino(struct tetris_engine *engine);
+static struct tetromino **initialize_tetrominos(int *npieces);
+static void free_tetrominos(struct tetromino **pieces, int npieces);
+static void rotate_tetromino_right(struct tetromino *piece);
+static void rotate_tetromino_left(struct tetromino *piece);
+static uint64_t engine_random(struct tetris_engine *engine);
+static void engine_new_piece(struct tetris_engine *engine);
+static void engine_move(struct tetris_engine *engine, int input);
+static int engine_drop(struct tetris_engine *engine);
+
+int engine_init(struct tetris_engine *engine, int nx, int ny, uint64_t seed) {
+  make_grid(&engine->game_grid,nx,ny);
+  if(engine->game_grid.data==NULL) {
+    return -1;
+  }
+
+  make_grid(&engine->current_grid,nx,ny);
+  if(engine->current_grid.data==NULL) {
+    free_grid(&engine->game_grid);
+    return -1;
+  }
+
+  engine->pieces = initialize_tetrominos(&engine->npieces);
+  if(engine->pieces==NULL) {
+    free_grid(&engine->game_grid);
+    free_grid(&engine->current_grid);
+    return -1;
+  }
+
+  engine->rng=seed;
+  engine->clock=0;
+  engine->drop_interval=start_drop_interval;
+  engine->over=0;
+  engine->over_start=0;
+  engine->view.visible=0;
+  engine->dirty.n=0;
+  engine->dirty.full=1;
+  engine->steps=0;
+  engine->pieces_played=0;
+  engine->rows_cleared=0;
+  engine->games=0;
+
+  engine_new_piece(engine);
+  return 0;
+}
+
+int engine_step(struct tetris_engine *engine, int input, uint64_t now) {
+  engine->clock=now;
+  engine->steps++;
+
+  if(engine->over) {
+    if(now-engine->over_start<game_over_pause) {
+      return 0;
+    }
+    clear_grid(&engine->current_grid);
+    copy_grid(&engine->current_grid,&engine->game_grid);
+    engine->drop_interval=start_drop_interval;
+    engine->dirty.full=1;
+    engine->over=0;
+    engine_new_piece(engine);
+    return 0;
+  }
+
+  engine_move(engine,input);
+
+  if((input&(ROTR|ROTL|RIGHT|LEFT))==0 && (input&DOWN)) {
+    return engine_drop(engine);
+  }
+  if(now-engine->drop_start>=engine->drop_interval) {
+    return engine_drop(engine);
+  }
+  return 0;
+}
+
+uint64_t engine_next_event(struct tetris_engine *engine) {
+  if(engine->over) {
+    return engine->over_start+game_over_pause;
+  }
+  return engine->drop_start+engine->drop_interval;
+}
+
+void engine_free(struct tetris_engine *engine) {
+  free_grid(&engine->game_grid);
+  free_grid(&engine->current_grid);
+  free_tetrominos(engine->pieces,engine->npieces);
+}
+
+/* splitmix64, so the pieces depend only on the seed and not on the C
+ * library's rand. */
+static uint64_t engine_random(struct tetris_engine *engine) {
+  uint64_t z;
+
+  engine->rng+=UINT64_C(0x9e3779b97f4a7c15);
+  z=engine->rng;
+  z=(z^(z>>30))*UINT64_C(0xbf58476d1ce4e5b9);
+  z=(z^(z>>27))*UINT64_C(0x94d049bb133111eb);
+  return z^(z>>31);
+}
+
+// Start a new piece at the top, falling from now
+static void engine_new_piece(struct tetris_engine *engine) {
+  copy_random_tetromino(engine);
+  engine->xpos=engine->game_grid.nx/2;
+  engine->ypos=engine->game_grid.ny-1;
+  engine->drop_start=engine->clock;
+  engine->pieces_played++;
+  update_piece(&engine->current_grid,&engine->game_grid,&engine->view,&engine->piece,engine->xpos,engine->ypos,&engine->dirty);
+}
+
+/* Rotations try a few nearby positions (a wall kick) and give up if none
+ * of them fit. */
+static void engine_move(struct tetris_engine *engine, int input) {
+  struct tetris_grid *grid = &engine->current_grid;
+  struct tetromino *piece = &engine->piece;
+  int xpos = engine->xpos;
+  int ypos = engine->ypos;
+
+  if(input&ROTR) {
+    rotate_tetromino_right(piece);
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos-=1;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos+=1;
+      ypos-=1;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      ypos+=2;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      ypos-=1;
+      xpos+=1;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos-=1;
+      rotate_tetromino_left(piece);
+    }
+  }
+  else if(input&ROTL) {
+    rotate_tetromino_left(piece);
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos+=1;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos-=1;
+      ypos-=1;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      ypos+=2;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      ypos-=1;
+      xpos-=1;
+    }
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos+=1;
+      rotate_tetromino_right(piece);
+    }
+  }
+  else if(input&RIGHT) {
+    xpos+=1;
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos-=1;
+    }
+  }
+  else if(input&LEFT) {
+    xpos-=1;
+    if(check_bounds_overlap(grid,piece,xpos,ypos)) {
+      xpos+=1;
+    }
+  }
+
+  engine->xpos=xpos;
+  engine->ypos=ypos;
+  update_piece(grid,&engine->game_grid,&engine->view,piece,xpos,ypos,&engine->dirty);
+}
+
+/* Moves the piece down a row, or lands it if it can't go. A piece that
+ * lands where it started ends the game. */
+static int engine_drop(struct tetris_engine *engine) {
+  struct tetris_grid *grid = &engine->current_grid;
+  int nrows_clear;
+  int events;
+
+  engine->drop_start=engine->clock;
+  if(!check_bounds_overlap(grid,&engine->piece,engine->xpos,engine->ypos-1)) {
+    engine->ypos-=1;
+    update_piece(grid,&engine->game_grid,&engine->view,&engine->piece,engine->xpos,engine->ypos,&engine->dirty);
+    return ENGINE_DROP;
+  }
+
+  engine->view.visible=0;
+  if(engine->ypos==grid->ny-1) {
+    engine->over=1;
+    engine->over_start=engine->clock;
+    engine->games++;
+    return ENGINE_GAME_OVER;
+  }
+
+  // The displayed grid already holds the piece where it landed
+  events=ENGINE_LAND;
+  nrows_clear=clear_full_rows(&engine->game_grid);
+  if(nrows_clear>0) {
+    if(engine->drop_interval>min_drop_interval) {
+      engine->drop_interval-=delta_drop_interval;
+    }
+    engine->rows_cleared+=nrows_clear;
+    engine->dirty.full=1;
+    events|=ENGINE_CLEAR;
+  }
+  copy_grid(&engine->game_grid,grid);
+
+  engine_new_piece(engine);
+  return events;
+}
+
+static void copy_random_tetromino(struct tetris_engine *engine) {
+  int piece_num=engine_random(engine)%engine->npieces;
+  int i;
+
+  engine->piece.color=engine->pieces[piece_num]->color;
+  for(i=0;i<4;i++) {
+    engine->piece.x[i]=engine->pieces[piece_num]->x[i];
+    engine->piece.y[i]=engine->pieces[piece_num]->y[i];
+  }
+}
+
+static struct tetromino **initialize_tetrominos(int *npieces) {
+  *npieces=7;
+  struct tetromino **pieces;
+
+  pieces = (struct tetromino **)malloc((*npieces)*sizeof(struct tetromino *));
+
+  if(pieces==NULL) return pieces;
+
+  /* Flat piece */
+  pieces[0] = (struct tetromino *)malloc(sizeof(struct tetromino));
+  if(pieces[0]==NULL) {
+    pieces=NULL;
+    return pieces;
+  }
+  pieces[0]->color=CYAN;
+  pieces[0]->x[0]=-1;
+  pieces[0]->y[0]=0;
+  pieces[0]->x[1]=0;
+  pieces[0]->y[1]=0;
+  pieces[0]->x[2]=1;
+  pieces[0]->y[2]=0;
+  pieces[0]->x[3]=2;
+  pieces[0]->y[3]=0;
+
+  /* Backward L piece */
+  pieces[1] = (struct tetromino *)malloc(sizeof(struct tetromino));
+  if(pieces[1]==NULL) {
+    pieces=NULL;
+    return pieces;
+  }
+  pieces[1]->color=BLUE;
+  pieces[1]->x[0]=-1;
+  pieces[1]->y[0]=1;
+  pieces[1]->x[1]=-1;
+  pieces[1]->y[1]=0;
+  pieces[1]->x[2]=0;
+  pieces[1]->y[2]=0;
+  pieces[1]->x[3]=1;
+  pieces[1]->y[3]=0;
+
+  /* L piece */
+  pieces[2] = (struct tetromino *)malloc(sizeof(struct tetromino));
+  if(pieces[2]==NULL) {
+    pieces=NULL;
+    return pieces;
+  }
+  pieces[2]->color=ORANGE;
+  pieces[2]->x[0]=1;
+  pieces[2]->y[0]=1;
+  pieces[2]->x[1]=-1;
+  pieces[2]->y[1]=0;
+  pieces[2]->x[2]=0;
+  pieces[2]->y[2]=0;
+  pieces[2]->x[3]=1;
+  pieces[2]->y[3]=0;
+
+  /* square piece */
+  pieces[3] = (struct tetromino *)malloc(sizeof(struct tetromino));
+  if(pieces[3]==NULL) {
+    pieces=NULL;
+    return pieces;
+  }
+  pieces[3]->color=YELLOW;
+  pieces[3]->x[0]=1;
+  pieces[3]->y[0]=1;
+  pieces[3]->x[1]=1;
+  pieces[3]->y[1]=0;
+  pieces[3]->x[2]=0;
+  pieces[3]->y[2]=0;
+  pieces[3]->x[3]=0;
+  pieces[3]->y[3]=1;
+
+  /* S piece */
+  pieces[4] = (struct tetromino *)malloc(sizeof(struct tetromino));
+  if(pieces[4]==NULL) {
+    pieces=NULL;
+    return pieces;
+  }
+  pieces[4]->color=GREEN;
+  pieces[4]->x[0]=1;
+  pieces[4]->y[0]=1;
+  pieces[4]->x[1]=0;
+  pieces[4]->y[1]=1;
+  pieces[4]->x[2]=0;
+  pieces[4]->y[2]=0;
+  pieces[4]->x[3]=-1;
+  pieces[4]->y[3]=0;
+
+  /* T piece */
+  pieces[5] = (struct tetromino *)malloc(sizeof(struct tetromino));
+  if(pieces[5]==NULL) {
+    pieces=NULL;
+    return pieces;
+  }
+  pieces[5]->color=PURPLE;
+  pieces[5]->x[0]=1;
+  pieces[5]->y[0]=0;
+  pieces[5]->x[1]=0;
+  pieces[5]->y[1]=1;
+  pieces[5]->x[2]=0;
+  pieces[5]->y[2]=0;
+  pieces[5]->x[3]=-1;
+  pieces[5]->y[3]=0;
+
+  /* Z piece */
+  pieces[6] = (struct tetromino *)malloc(sizeof(struct tetromino));
+  if(pieces[6]==NULL) {
+    pieces=NULL;
+    return pieces;
+  }
+  pieces[6]->color=RED;
+  pieces[6]->x[0]=-1;
+  pieces[6]->y[0]=0;
+  pieces[6]->x[1]=0;
+  pieces[6]->y[1]=0;
+  pieces[6]->x[2]=0;
+  pieces[6]->y[2]=-1;
+  pieces[6]->x[3]=1;
+  pieces[6]->y[3]=-1;
+
+  return pieces;
+}
+
+static void free_tetrominos(struct tetromino **pieces, int npieces) {
+  int i;
+
+  for(i=0;i<npieces;i++) {
+    free(pieces[i]);
+  }
+
+  free(pieces);
+}
+
+static void rotate_tetromino_right(struct tetromino *piece) {
+  int i;
+  int temp;
+
+  for(i=0;i<4;i++) {
+    temp=piece->x[i];
+    piece->x[i]=piece->y[i];
+    piece->y[i]=-temp;
+  }
+}
+
+static void rotate_tetromino_left(struct tetromino *piece) {
+  int i;
+  int temp;
+
+  for(i=0;i<4;i++) {
+    temp=piece->x[i];
+    piece->x[i]=-piece->y[i];
+    piece->y[i]=temp;
+  }
+}
+
+void initialize_palette(tcl_palette *palette) {
+  palette_init(palette);
+
+  palette_set(palette,EMPTY,0x00,0x00,0x00);
+  palette_set(palette,CYAN,0x00,0x8b,0x8b);
+  palette_set(palette,BLUE,0x00,0x00,0xff);
+  palette_set(palette,ORANGE,0xff,0x60,0x00);
+  palette_set(palette,YELLOW,0xff,0xb0,0x00);
+  palette_set(palette,GREEN,0x00,0x80,0x00);
+  palette_set(palette,PURPLE,0x55,0x28,0xd0);
+  palette_set(palette,RED,0xff,0x00,0x00);
+}
@@ -0,0 +1,77 @@
+#ifndef _ENGINE_H
+#define _ENGINE_H
+#include <stdint.h>
+#include "palette.h"
+#include "grid.h"
+
+/*****************************************************************************
+ * The game itself, apart from the wall, the buttons and the real clock, so
+ * it can run on a regular computer as fast as it will go. Everything the
+ * game needs is in a tetris_engine: the grids, the falling piece, its own
+ * random number generator and a virtual clock in microseconds that only
+ * moves when the caller says so. Two engines started with the same seed
+ * and given the same inputs at the same times play the same game.
+ *
+ * engine_init:
+ * Sets up an empty nx by ny game with the random pieces seeded by seed and
+ * the first piece at the top at time 0. Returns <0 on error.
+ *
+ * engine_step:
+ * Moves the clock to now, which must not go backwards, and plays one step:
+ * the buttons in input (a mask of the ROTR, ROTL, LEFT, RIGHT and DOWN bits
+ * from input.h, as input_wait returns them) move the piece, and the piece
+ * drops a row if DOWN was pressed or its drop interval has gone by. As on
+ * the wall only one button counts per step, rotation first. Returns a mask
+ * of the ENGINE_ events that happened. After a game is lost the board stays
+ * up for a few seconds of clock time before a new game starts, and input
+ * is ignored until then.
+ *
+ * engine_next_event:
+ * Returns the clock time at which the engine next has something to do
+ * without any input, so the caller knows how long it can wait.
+ *
+ * initialize_palette:
+ * Fills in the colors of the pieces.
+ *
+ * engine_free:
+ * Frees the grids and pieces.
+ *
+ * game_grid is what should be shown, with the falling piece drawn in, and
+ * dirty lists the cells of it that changed, for load_dirty. current_grid
+ * holds only the pieces that have landed.
+ * **************************************************************************/
+
+#define ENGINE_DROP (1<<0) /* the piece fell a row */
+#define ENGINE_LAND (1<<1) /* the piece landed and a new one started */
+#define ENGINE_CLEAR (1<<2) /* full rows were removed */
+#define ENGINE_GAME_OVER (1<<3)
+
+struct tetris_engine {
+  struct tetris_grid game_grid;
+  struct tetris_grid current_grid;
+  struct tetromino **pieces;
+  int npieces;
+  struct tetromino piece; // the falling piece
+  int xpos, ypos;
+  struct piece_view view;
+  struct dirty_cells dirty;
+  uint64_t rng;
+  uint64_t clock; // virtual microseconds, 64 bits so it never wraps
+  uint64_t drop_start; // when the piece last fell or appeared
+  uint64_t drop_interval;
+  int over; // the game is lost and the board is on show
+  uint64_t over_start; // when it was lost
+  /* Counts since engine_init */
+  unsigned long steps;
+  unsigned long pieces_played;
+  unsigned long rows_cleared;
+  unsigned long games;
+};
+
+int engine_init(struct tetris_engine *engine, int nx, int ny, uint64_t seed);
+int engine_step(struct tetris_engine *engine, int input, uint64_t now);
+uint64_t engine_next_event(struct tetris_engine *engine);
+void initialize_palette(tcl_palette *palette);
+void engine_free(struct tetris_engine *engine);
+
+#endif /*!_ENGINE_H*/
@@ -0,0 +1,292 @@
+#include "grid.h"
+#include <string.h>
+
+void make_grid(struct tetris_grid *grid, int nx, int ny) {
+  int i;
+  int points;
+
+  grid->nx=nx;
+  grid->ny=ny;
+  grid->data=NULL;
+  grid->rows=NULL;
+
+  if(nx>32-2*WALL_PAD) {
+    return;
+  }
+
+  points = nx*ny;
+
+  grid->data = (uint8_t*)malloc((points+1)*sizeof(uint8_t));
+  if(grid->data==NULL) {
+    return;
+  }
+
+  grid->rows = (uint32_t*)malloc(ny*sizeof(uint32_t));
+  if(grid->rows==NULL) {
+    free(grid->data);
+    grid->data=NULL;
+    return;
+  }
+
+  grid->empty_row = ~(((UINT32_C(1)<<nx)-1)<<WALL_PAD);
+
+  for(i=0;i<=points;i++) {
+    grid->data[i]=EMPTY;
+  }
+  for(i=0;i<ny;i++) {
+    grid->rows[i]=grid->empty_row;
+  }
+}
+
+void free_grid(struct tetris_grid *grid) {
+  free(grid->data);
+  free(grid->rows);
+}
+
+uint8_t get_point(struct tetris_grid *grid, int x, int y) {
+  uint8_t retchar = EMPTY;
+
+  if(x>=0 && x<grid->nx && y>=0 && y<grid->ny) {
+    retchar = grid->data[x+grid->nx*y];
+  }
+
+  return retchar;
+}
+
+void set_point(struct tetris_grid *grid, int x, int y, uint8_t c) {
+  if(x>=0 && x<grid->nx && y>=0 && y<grid->ny) {
+    grid->data[x+grid->nx*y]=c;
+    if(c==EMPTY) {
+      grid->rows[y] &= ~(UINT32_C(1)<<(x+WALL_PAD));
+    }
+    else {
+      grid->rows[y] |= UINT32_C(1)<<(x+WALL_PAD);
+    }
+  }
+}
+
+/* Occupancy of row y. Below the floor is solid, above the top only the
+ * walls are. */
+uint32_t get_row_bits(struct tetris_grid *grid, int y) {
+  if(y<0) {
+    return FULL_ROW;
+  }
+  if(y>=grid->ny) {
+    return grid->empty_row;
+  }
+  return grid->rows[y];
+}
+
+void copy_grid(struct tetris_grid *source, struct tetris_grid *destination) {
+  memcpy(destination->data,source->data,source->nx*source->ny*sizeof(uint8_t));
+  memcpy(destination->rows,source->rows,source->ny*sizeof(uint32_t));
+}
+
+void combine_grid(struct tetris_grid *ingrid, struct tetromino *piece, int xoff, int yoff, struct tetris_grid *outgrid) {
+  int i;
+
+  copy_grid(ingrid,outgrid);
+
+  for(i=0;i<4;i++) {
+    set_point(outgrid,piece->x[i]+xoff,piece->y[i]+yoff,piece->color);
+  }
+}
+
+int clear_full_rows(struct tetris_grid *grid) {
+  int j;
+  int dest=0;
+
+  // Slide every row that isn't full down over the full ones
+  for(j=0;j<grid->ny;j++) {
+    if(grid->rows[j]==FULL_ROW) {
+      continue;
+    }
+    if(dest!=j) {
+      memcpy(&grid->data[grid->nx*dest],&grid->data[grid->nx*j],grid->nx*sizeof(uint8_t));
+      grid->rows[dest]=grid->rows[j];
+    }
+    dest++;
+  }
+
+  for(j=dest;j<grid->ny;j++) {
+    memset(&grid->data[grid->nx*j],EMPTY,grid->nx*sizeof(uint8_t));
+    grid->rows[j]=grid->empty_row;
+  }
+
+  return grid->ny-dest;
+}
+
+void clear_grid(struct tetris_grid *grid) {
+  int j;
+
+  memset(grid->data,EMPTY,grid->nx*grid->ny*sizeof(uint8_t));
+  for(j=0;j<grid->ny;j++) {
+    grid->rows[j]=grid->empty_row;
+  }
+}
+
+int check_bounds_overlap(struct tetris_grid *grid, struct tetromino *piece, int xoff, int yoff) {
+  int i;
+  int bit;
+
+  for(i=0;i<4;i++) {
+    bit = xoff+piece->x[i]+WALL_PAD;
+    // Too far past the walls to be represented in a row
+    if(bit<0 || bit>=32) {
+      return 1;
+    }
+    if(get_row_bits(grid,yoff+piece->y[i]) & (UINT32_C(1)<<bit)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int make_led_map(struct led_map *map, const struct wall_geometry *geometry, struct tetris_grid *grid) {
+  int strip;
+  int k;
+  int column, row;
+  int x, y;
+  int up;
+  int *cell;
+  int ncells;
+  int i;
+
+  map->leds = geometry->columns*geometry->rows;
+  ncells = grid->nx*grid->ny;
+  map->cell = (int*)malloc(map->leds*sizeof(int));
+  map->cell_start = (int*)malloc((ncells+3)*sizeof(int));
+  map->cell_leds = (int*)malloc(map->leds*sizeof(int));
+  if(map->cell==NULL || map->cell_start==NULL || map->cell_leds==NULL) {
+    free(map->cell);
+    free(map->cell_start);
+    free(map->cell_leds);
+    return -1;
+  }
+
+  // Walk the strips in the order they are chained
+  cell = map->cell;
+  for(strip=0;strip<geometry->columns;strip++) {
+    column = geometry->start_right ? geometry->columns-1-strip : strip;
+    up = (strip%2==0) ? geometry->first_up : !geometry->first_up;
+    for(k=0;k<geometry->rows;k++) {
+      row = up ? k : geometry->rows-1-k;
+      x = column/geometry->expand;
+      y = row/geometry->expand;
+      if(x<grid->nx && y<grid->ny) {
+        *cell = x+grid->nx*y;
+      }
+      else {
+        *cell = grid->nx*grid->ny;
+      }
+      cell++;
+    }
+  }
+
+  // Invert the table so each cell knows which LEDs draw it. Counts go two
+  // places up so that filling cell_leds leaves the start of every cell,
+  // including the off cell, in cell_start.
+  for(i=0;i<ncells+3;i++) {
+    map->cell_start[i]=0;
+  }
+  for(i=0;i<map->leds;i++) {
+    map->cell_start[map->cell[i]+2]++;
+  }
+  for(i=2;i<ncells+3;i++) {
+    map->cell_start[i]+=map->cell_start[i-1];
+  }
+  for(i=0;i<map->leds;i++) {
+    map->cell_leds[map->cell_start[map->cell[i]+1]++]=i;
+  }
+
+  return 0;
+}
+
+void free_led_map(struct led_map *map) {
+  free(map->cell);
+  free(map->cell_start);
+  free(map->cell_leds);
+  map->cell=NULL;
+  map->cell_start=NULL;
+  map->cell_leds=NULL;
+  map->leds=0;
+}
+
+void load_grid(struct tetris_grid *grid, tcl_buffer *buf, struct led_map *map, tcl_palette *palette) {
+  palette_render(palette,grid->data,map->cell,buf->pixels,map->leds);
+}
+
+void mark_dirty(struct dirty_cells *dirty, struct tetris_grid *grid, int x, int y) {
+  int i;
+  int cell;
+
+  if(dirty->full || x<0 || x>=grid->nx || y<0 || y>=grid->ny) {
+    return;
+  }
+
+  cell = x+grid->nx*y;
+  for(i=0;i<dirty->n;i++) {
+    if(dirty->cell[i]==cell) return;
+  }
+
+  if(dirty->n==MAX_DIRTY) {
+    dirty->full=1;
+    return;
+  }
+  dirty->cell[dirty->n++]=cell;
+}
+
+void update_piece(struct tetris_grid *base, struct tetris_grid *shown_grid, struct piece_view *view, struct tetromino *piece, int xoff, int yoff, struct dirty_cells *dirty) {
+  int i;
+  int x, y;
+
+  if(view->visible && view->x==xoff && view->y==yoff &&
+      memcmp(&view->piece,piece,sizeof(struct tetromino))==0) {
+    return;
+  }
+
+  // Restore what was under the old footprint, then draw the new one
+  if(view->visible) {
+    for(i=0;i<4;i++) {
+      x=view->piece.x[i]+view->x;
+      y=view->piece.y[i]+view->y;
+      set_point(shown_grid,x,y,get_point(base,x,y));
+      mark_dirty(dirty,shown_grid,x,y);
+    }
+  }
+
+  for(i=0;i<4;i++) {
+    x=piece->x[i]+xoff;
+    y=piece->y[i]+yoff;
+    set_point(shown_grid,x,y,piece->color);
+    mark_dirty(dirty,shown_grid,x,y);
+  }
+
+  view->visible=1;
+  view->piece=*piece;
+  view->x=xoff;
+  view->y=yoff;
+}
+
+void load_dirty(struct tetris_grid *grid, tcl_buffer *buf, struct led_map *map, tcl_palette *palette, struct dirty_cells *dirty) {
+  int i, k;
+  int cell;
+  tcl_color color;
+
+  if(dirty->full) {
+    load_grid(grid,buf,map,palette);
+  }
+  else {
+    for(i=0;i<dirty->n;i++) {
+      cell=dirty->cell[i];
+      color=palette->colors[grid->data[cell]];
+      for(k=map->cell_start[cell];k<map->cell_start[cell+1];k++) {
+        buf->pixels[map->cell_leds[k]]=color;
+      }
+    }
+  }
+
+  dirty->full=0;
+  dirty->n=0;
+}
@@ -0,0 +1,122 @@
+#ifndef _GRID_H
+#define _GRID_H
+#include <stdint.h>
+#include "tclled.h"
+#include "palette.h"
+
+/*****************************************************************************
+ * The playing field and how it is drawn on the LED wall.
+ *
+ * make_grid:
+ * Allocates an nx by ny grid with every cell EMPTY. On failure data is NULL.
+ *
+ * copy_grid, combine_grid:
+ * Copy one grid into another of the same size, combine_grid then draws the
+ * piece at (xoff, yoff) on top.
+ *
+ * clear_full_rows:
+ * Removes every full row, moving the rows above down. Returns the number of
+ * rows removed.
+ *
+ * check_bounds_overlap:
+ * Returns nonzero if the piece at (xoff, yoff) would hit a wall, the floor
+ * or an occupied cell.
+ *
+ * make_led_map:
+ * Builds the table from LED chain position to grid cell for the given wall
+ * geometry. Returns <0 on error.
+ *
+ * load_grid:
+ * Encodes every LED of the grid into buf.
+ *
+ * update_piece:
+ * Moves the falling piece shown in shown_grid to (xoff, yoff), restoring the
+ * cells it leaves from base, and records the changed cells in dirty.
+ *
+ * load_dirty:
+ * Encodes only the LEDs of the cells in dirty, or every LED if a full
+ * render is needed, and empties dirty.
+ * **************************************************************************/
+
+/* Palette indices stored in the grid cells */
+enum cell_color { EMPTY=0, CYAN, BLUE, ORANGE, YELLOW, GREEN, PURPLE, RED };
+
+/* Occupancy rows keep cell x in bit x+WALL_PAD and set every bit outside
+ * the playing field, so the walls collide like any other block and a
+ * completely filled row reads as FULL_ROW. Grids can be up to
+ * 32-2*WALL_PAD cells wide. */
+#define WALL_PAD 4
+#define FULL_ROW UINT32_C(0xffffffff)
+
+/* The grid holds one palette index per cell, plus one trailing cell that
+ * is always EMPTY for LEDs that fall outside the playing field, and an
+ * occupancy bitboard kept in step with the cells by set_point. */
+struct tetris_grid {
+  int nx;
+  int ny;
+  uint8_t *data;
+  uint32_t *rows; // occupancy of each row, walls included
+  uint32_t empty_row; // a row with only the walls set
+};
+
+/* Layout of the LED wall. The LEDs are chained as vertical strips that
+ * alternate direction (a serpentine), and each grid cell is drawn as an
+ * expand x expand block of LEDs. */
+struct wall_geometry {
+  int columns; // number of LED strips across the wall
+  int rows; // LEDs on each strip
+  int start_right; // chain begins at the rightmost strip
+  int first_up; // first strip in the chain runs from row 0 upward
+  int expand; // LEDs per grid cell along each axis
+};
+
+struct led_map {
+  int leds;
+  int *cell; // grid cell for each LED in chain order, border LEDs use the off cell
+  int *cell_start; // cell c is drawn by cell_leds[cell_start[c]..cell_start[c+1]-1]
+  int *cell_leds;
+};
+
+struct tetromino {
+  uint8_t color;
+  int x[4];
+  int y[4];
+};
+
+/* Where the falling piece is currently drawn in the displayed grid */
+struct piece_view {
+  int visible;
+  struct tetromino piece;
+  int x;
+  int y;
+};
+
+#define MAX_DIRTY 32
+
+/* Cells changed since the last frame was encoded. If more cells change
+ * than fit, or rows were cleared, the whole frame is re-rendered. */
+struct dirty_cells {
+  int full;
+  int n;
+  int cell[MAX_DIRTY];
+};
+
+void make_grid(struct tetris_grid *grid, int nx, int ny);
+void free_grid(struct tetris_grid *grid);
+uint8_t get_point(struct tetris_grid *grid, int x, int y);
+void set_point(struct tetris_grid *grid, int x, int y, uint8_t c);
+uint32_t get_row_bits(struct tetris_grid *grid, int y);
+void copy_grid(struct tetris_grid *source, struct tetris_grid *destination);
+void combine_grid(struct tetris_grid *ingrid, struct tetromino *piece, int xoff, int yoff, struct tetris_grid *outgrid);
+int clear_full_rows(struct tetris_grid *grid);
+void clear_grid(struct tetris_grid *grid);
+int check_bounds_overlap(struct tetris_grid *grid, struct tetromino *piece, int xoff, int yoff);
+
+int make_led_map(struct led_map *map, const struct wall_geometry *geometry, struct tetris_grid *grid);
+void free_led_map(struct led_map *map);
+void load_grid(struct tetris_grid *grid, tcl_buffer *buf, struct led_map *map, tcl_palette *palette);
+void mark_dirty(struct dirty_cells *dirty, struct tetris_grid *grid, int x, int y);
+void update_piece(struct tetris_grid *base, struct tetris_grid *shown_grid, struct piece_view *view, struct tetromino *piece, int xoff, int yoff, struct dirty_cells *dirty);
+void load_dirty(struct tetris_grid *grid, tcl_buffer *buf, struct led_map *map, tcl_palette *palette, struct dirty_cells *dirty);
+
+#endif /*!_GRID_H*/
@@ -0,0 +1,1167 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include "hashtable.h"
+
+/* With -t alloc (the default) inserts the same keys into each kind of
+ * table and reports inserts per second, the resident memory the table
+ * added, the malloc calls it made and how long hashtable_free took. Each
+ * configuration runs in its own process so one run's freed memory doesn't
+ * flatter the next.
+ *
+ * With -t hash times each built in hash function over several key sizes
+ * and shows how evenly it spreads the keys over a chained table's buckets.
+ * The keys are sequential integers padded with zeros to the key size, the
+ * same pattern as hashtest's int keys.
+ *
+ * With -t threads runs 1, 2, 4 and 8 threads against one
+ * HASHTABLE_CONCURRENT table, each doing the same number of operations,
+ * first reads only and then with one write in ten, and reports the total
+ * operations per second.
+ *
+ * With -t batch fills chained and open tables with 1K, 100K and 10M int
+ * keys and times random lookups done one hashtable_get at a time against
+ * hashtable_get_many over frame sized batches of 1250 keys.
+ *
+ * With -t suite runs insert, get (hits and misses), iterate (with an
+ * iterator and with hashtable_foreach) and remove on
+ * chained and open tables from 16 to 10M entries (or -n), for 4, 16 and 64
+ * byte keys that are either sequential or random, and adds what
+ * hashtable_stats says about each table. Small tables are rebuilt until
+ * each operation has run at least suite_ops times. The tables hash with
+ * mulmix64 so the numbers are about the table rather than FNV-1a. Use -m
+ * and keep the output to compare changes to hashtable.c against.
+ *
+ * With -t typed fills tables of 1K, 100K and 1M int keys and int values,
+ * and times inserts, random hits and misses in a generic open table
+ * hashing with inthash64 against a DECLARE_HASHTABLE table of int to int.
+ *
+ * With -t upsert counts 2M random keys out of 1K, 100K and 1M in chained
+ * and open tables, once with hashtable_get and then hashtable_insert of the
+ * new count and once by incrementing the count hashtable_emplace returns.
+ * The counts are 32 byte structures, so they live outside the entries.
+ *
+ * With -t snapshot builds open tables of 1K, 100K and 1M int keys, writes
+ * each with hashtable_snapshot, and compares building the table by
+ * inserting every entry against opening the file with hashtable_map, with
+ * and without validation, then times random lookups in both. The file is
+ * in the page cache by then, so the map time leaves out the disk.
+ *
+ * With -t freeze fills chained and open tables with 1K, 100K, 1M and 10M
+ * int keys, times hashtable_freeze on the open one and compares the heap
+ * bytes of the open and frozen tables, then times random hits in all
+ * three and random misses in the open and frozen tables. */
+
+static const int default_keys = 1000000;
+static const size_t initial_size = 1024;
+
+struct bench_config {
+  const char *name;
+  int flags;
+};
+
+static const struct bench_config configs[] = {
+  { "chained", HASHTABLE_CHAINED },
+  { "chained+pool", HASHTABLE_CHAINED|HASHTABLE_POOL },
+  { "open", HASHTABLE_OPEN },
+  { "open+pool", HASHTABLE_OPEN|HASHTABLE_POOL },
+};
+#define NCONFIGS (sizeof(configs)/sizeof(configs[0]))
+
+struct hash_config {
+  const char *name;
+  uint64_t (*hashfunc)(void *, size_t);
+  int int_only; // only meaningful for 4 and 8 byte keys
+};
+
+static const struct hash_config hashes[] = {
+  { "fnv1a64", fnv1a64, 0 },
+  { "mulmix64", mulmix64, 0 },
+  { "inthash64", inthash64, 1 },
+};
+#define NHASHES (sizeof(hashes)/sizeof(hashes[0]))
+
+static const size_t key_sizes[] = { 4, 8, 16, 32, 64, 256, 1024 };
+#define NKEY_SIZES (sizeof(key_sizes)/sizeof(key_sizes[0]))
+static const int hash_keys = 100000;
+static const size_t hash_buckets = 131072;
+static const double hash_bytes = 256e6; // bytes hashed per timing
+#define CHAIN_HISTOGRAM 5
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+#define NTHREAD_COUNTS (sizeof(thread_counts)/sizeof(thread_counts[0]))
+static const int write_percents[] = { 0, 10 };
+#define NWRITE_PERCENTS (sizeof(write_percents)/sizeof(write_percents[0]))
+static const int thread_keys = 100000;
+static const int thread_ops = 2000000; // per thread
+
+static const int batch_entries[] = { 1000, 100000, 10000000 };
+#define NBATCH_ENTRIES (sizeof(batch_entries)/sizeof(batch_entries[0]))
+static const int batch_lookups = 1000000;
+static const int batch_size = 1250; // LEDs in a frame
+
+static const int suite_entries[] = { 16, 1000, 100000, 10000000 };
+#define NSUITE_ENTRIES (sizeof(suite_entries)/sizeof(suite_entries[0]))
+static const size_t suite_key_sizes[] = { 4, 16, 64 };
+#define NSUITE_KEY_SIZES (sizeof(suite_key_sizes)/sizeof(suite_key_sizes[0]))
+static const char *suite_dists[] = { "seq", "random" };
+static const int suite_ops = 1000000;
+
+static const int typed_entries[] = { 1000, 100000, 1000000 };
+#define NTYPED_ENTRIES (sizeof(typed_entries)/sizeof(typed_entries[0]))
+static const int typed_lookups = 1000000;
+
+static const int upsert_keys[] = { 1000, 100000, 1000000 };
+#define NUPSERT_KEYS (sizeof(upsert_keys)/sizeof(upsert_keys[0]))
+static const int upsert_ops = 2000000;
+
+struct upsert_count {
+  long count;
+  long first;
+  long last;
+  long pad;
+};
+
+static const int snapshot_entries[] = { 1000, 100000, 1000000 };
+#define NSNAPSHOT_ENTRIES (sizeof(snapshot_entries)/sizeof(snapshot_entries[0]))
+static const int snapshot_lookups = 1000000;
+static const char *snapshot_path = "hashbench.snap";
+
+static const int freeze_entries[] = { 1000, 100000, 1000000, 10000000 };
+#define NFREEZE_ENTRIES (sizeof(freeze_entries)/sizeof(freeze_entries[0]))
+static const int freeze_lookups = 1000000;
+
+enum suite_op { OP_INSERT, OP_HIT, OP_MISS, OP_ITERATE, OP_FOREACH, OP_REMOVE, NSUITE_OPS };
+static const char *suite_op_names[NSUITE_OPS] = { "insert", "get_hit", "get_miss", "iterate", "foreach", "remove" };
+
+struct thread_config {
+  hashtable *hashtbl;
+  pthread_barrier_t *start;
+  int write_percent;
+  unsigned int seed;
+};
+
+double now_us();
+long resident_kb();
+void run_config(const struct bench_config *config, int keys, int machine);
+void run_hashes(int machine);
+void run_hash(const struct hash_config *config, size_t key_size, int machine);
+void run_threads(int machine);
+void run_batches(int machine);
+DECLARE_HASHTABLE(intmap, int, int, hashtable_mix64, hashtable_eq_scalar)
+
+void run_typed(int machine);
+void run_upserts(int machine);
+void run_snapshots(int machine);
+void run_freezes(int machine);
+double time_gets(hashtable *hashtbl, int *keys, int n, size_t expect);
+void run_suite(int max_entries, int machine);
+void run_suite_config(int flags, size_t key_size, int dist, int entries, int machine);
+void suite_key(uint8_t *key, size_t key_size, int dist, uint64_t i);
+int suite_visit(void *key, size_t key_size, void *data, size_t data_size, void *ctx);
+uint64_t splitmix64(uint64_t x);
+void *thread_ops_loop(void *arg);
+
+int main(int argc, char *argv[]) {
+  int keys = default_keys;
+  int keys_given = 0;
+  int machine = 0;
+  const char *test = "alloc";
+  int opt;
+  int i;
+  pid_t pid;
+
+  while((opt=getopt(argc,argv,"n:mt:"))!=-1) {
+    switch(opt) {
+      case 't':
+        test = optarg;
+        break;
+      case 'n':
+        keys = atoi(optarg);
+        keys_given = 1;
+        break;
+      case 'm':
+        machine = 1;
+        break;
+      default:
+        fprintf(stderr,"Usage: %s [-t alloc|hash|threads|batch|suite|typed|upsert|snapshot|freeze] [-n keys] [-m]\n",argv[0]);
+        exit(1);
+    }
+  }
+  if(keys<=0) {
+    fprintf(stderr,"Key count must be positive.\n");
+    exit(1);
+  }
+
+  if(strcmp(test,"hash")==0) {
+    run_hashes(machine);
+    exit(0);
+  }
+  if(strcmp(test,"suite")==0) {
+    run_suite(keys_given ? keys : suite_entries[NSUITE_ENTRIES-1],machine);
+    exit(0);
+  }
+  if(strcmp(test,"typed")==0) {
+    run_typed(machine);
+    exit(0);
+  }
+  if(strcmp(test,"upsert")==0) {
+    run_upserts(machine);
+    exit(0);
+  }
+  if(strcmp(test,"snapshot")==0) {
+    run_snapshots(machine);
+    exit(0);
+  }
+  if(strcmp(test,"freeze")==0) {
+    run_freezes(machine);
+    exit(0);
+  }
+  if(strcmp(test,"batch")==0) {
+    run_batches(machine);
+    exit(0);
+  }
+  if(strcmp(test,"threads")==0) {
+    run_threads(machine);
+    exit(0);
+  }
+  if(strcmp(test,"alloc")!=0) {
+    fprintf(stderr,"Unknown test %s\n",test);
+    exit(1);
+  }
+
+  if(machine) {
+    printf("config\tkeys\tinserts_per_s\trss_kb\tallocations\tfree_ms\n");
+  }
+  else {
+    printf("%d keys of %zu bytes, %zu byte values\n",keys,sizeof(uint64_t),sizeof(uint64_t));
+  }
+  fflush(stdout);
+
+  for(i=0;i<NCONFIGS;i++) {
+    pid = fork();
+    if(pid<0) {
+      perror("fork");
+      exit(1);
+    }
+    if(pid==0) {
+      run_config(&configs[i],keys,machine);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid,NULL,0);
+  }
+
+  exit(0);
+}
+
+void run_config(const struct bench_config *config, int keys, int machine) {
+  hashtable *hashtbl;
+  uint64_t key;
+  int i;
+  long rss_before, rss_after;
+  double start, insert_time, free_time;
+  size_t allocations;
+
+  rss_before = resident_kb();
+
+  hashtbl = hashtable_create_flags(initial_size,NULL,config->flags);
+  if(!hashtbl) {
+    fprintf(stderr,"Table allocation error\n");
+    exit(1);
+  }
+
+  start = now_us();
+  for(i=0;i<keys;i++) {
+    key = (uint64_t)i*UINT64_C(0x9e3779b97f4a7c15);
+    if(hashtable_insert(hashtbl,&key,sizeof(key),&key,sizeof(key))<0) {
+      fprintf(stderr,"Insertion error at %d\n",i);
+      exit(1);
+    }
+  }
+  insert_time = now_us()-start;
+
+  rss_after = resident_kb();
+  allocations = hashtbl->allocations;
+
+  start = now_us();
+  hashtable_free(hashtbl);
+  free_time = now_us()-start;
+
+  if(machine) {
+    printf("%s\t%d\t%.0f\t%ld\t%zu\t%.3f\n",config->name,keys,
+        keys/insert_time*1e6,rss_after-rss_before,allocations,free_time/1000);
+  }
+  else {
+    printf("%-14s %12.0f inserts/s %9.1f MB %10zu mallocs %9.2f ms free\n",config->name,
+        keys/insert_time*1e6,(rss_after-rss_before)/1024.0,allocations,free_time/1000);
+  }
+}
+
+void run_hashes(int machine) {
+  int i, k;
+
+  if(machine) {
+    printf("hash\tkey_size\tgb_per_s\tempty_pct\tmax_chain");
+    for(i=0;i<CHAIN_HISTOGRAM;i++) {
+      printf("\tchains_%d",i);
+    }
+    printf("\n");
+  }
+  else {
+    printf("%d keys in %zu buckets; chain length counts 0..%d+\n",hash_keys,hash_buckets,CHAIN_HISTOGRAM-1);
+  }
+
+  for(k=0;k<NKEY_SIZES;k++) {
+    for(i=0;i<NHASHES;i++) {
+      if(hashes[i].int_only && key_sizes[k]!=4 && key_sizes[k]!=8) {
+        continue;
+      }
+      run_hash(&hashes[i],key_sizes[k],machine);
+    }
+  }
+}
+
+void run_hash(const struct hash_config *config, size_t key_size, int machine) {
+  uint8_t *keys;
+  uint32_t *chains;
+  int histogram[CHAIN_HISTOGRAM];
+  uint32_t max_chain;
+  size_t empty;
+  uint64_t sink;
+  double start, elapsed;
+  int rounds, r, i;
+  size_t b;
+
+  keys = (uint8_t *)calloc(hash_keys,key_size);
+  chains = (uint32_t *)calloc(hash_buckets,sizeof(uint32_t));
+  if(!keys || !chains) {
+    fprintf(stderr,"Memory error\n");
+    exit(1);
+  }
+
+  for(i=0;i<hash_keys;i++) {
+    memcpy(keys+i*key_size,&i,sizeof(i));
+  }
+
+  // Bucket each key the way a chained table of hash_buckets would
+  for(i=0;i<hash_keys;i++) {
+    chains[config->hashfunc(keys+i*key_size,key_size)%hash_buckets]++;
+  }
+  memset(histogram,0,sizeof(histogram));
+  max_chain = 0;
+  empty = 0;
+  for(b=0;b<hash_buckets;b++) {
+    if(chains[b]>max_chain) max_chain = chains[b];
+    if(chains[b]==0) empty++;
+    histogram[chains[b]<CHAIN_HISTOGRAM ? chains[b] : CHAIN_HISTOGRAM-1]++;
+  }
+
+  rounds = (int)(hash_bytes/((double)hash_keys*key_size))+1;
+  sink = 0;
+  start = now_us();
+  for(r=0;r<rounds;r++) {
+    for(i=0;i<hash_keys;i++) {
+      sink += config->hashfunc(keys+i*key_size,key_size);
+    }
+  }
+  elapsed = now_us()-start;
+  if(sink==1) {
+    printf("\n"); // keeps the loop from being optimized away
+  }
+
+  if(machine) {
+    printf("%s\t%zu\t%.3f\t%.2f\t%u",config->name,key_size,
+        (double)rounds*hash_keys*key_size/elapsed/1e3,100.0*empty/hash_buckets,max_chain);
+    for(i=0;i<CHAIN_HISTOGRAM;i++) {
+      printf("\t%d",histogram[i]);
+    }
+    printf("\n");
+  }
+  else {
+    printf("%-10s %5zu bytes %8.2f GB/s %6.1f ns/key  empty %5.1f%%  max chain %2u  [",config->name,key_size,
+        (double)rounds*hash_keys*key_size/elapsed/1e3,elapsed*1e3/((double)rounds*hash_keys),
+        100.0*empty/hash_buckets,max_chain);
+    for(i=0;i<CHAIN_HISTOGRAM;i++) {
+      printf(i ? " %d" : "%d",histogram[i]);
+    }
+    printf("]\n");
+  }
+
+  free(keys);
+  free(chains);
+}
+
+void run_threads(int machine) {
+  hashtable *hashtbl;
+  pthread_t threads[8];
+  struct thread_config configs[8];
+  pthread_barrier_t start;
+  double start_time, elapsed;
+  int w, t, i, nthreads;
+
+  hashtbl = hashtable_create_flags(thread_keys,inthash64,HASHTABLE_CONCURRENT);
+  if(!hashtbl) {
+    fprintf(stderr,"Table allocation error\n");
+    exit(1);
+  }
+  for(i=0;i<thread_keys;i++) {
+    hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+  }
+
+  if(machine) {
+    printf("threads\twrite_pct\tops\tmops_per_s\n");
+  }
+  else {
+    printf("%d int keys, %d operations per thread\n",thread_keys,thread_ops);
+  }
+
+  for(w=0;w<NWRITE_PERCENTS;w++) {
+    for(t=0;t<NTHREAD_COUNTS;t++) {
+      nthreads = thread_counts[t];
+      pthread_barrier_init(&start,NULL,nthreads+1);
+      for(i=0;i<nthreads;i++) {
+        configs[i].hashtbl=hashtbl;
+        configs[i].start=&start;
+        configs[i].write_percent=write_percents[w];
+        configs[i].seed=i+1;
+        if(pthread_create(&threads[i],NULL,thread_ops_loop,&configs[i])!=0) {
+          fprintf(stderr,"Unable to start thread %d\n",i);
+          exit(1);
+        }
+      }
+
+      pthread_barrier_wait(&start);
+      start_time = now_us();
+      for(i=0;i<nthreads;i++) {
+        pthread_join(threads[i],NULL);
+      }
+      elapsed = now_us()-start_time;
+      pthread_barrier_destroy(&start);
+
+      if(machine) {
+        printf("%d\t%d\t%ld\t%.3f\n",nthreads,write_percents[w],(long)nthreads*thread_ops,
+            (double)nthreads*thread_ops/elapsed);
+      }
+      else {
+        printf("%d threads, %2d%% writes: %8.2f Mops/s\n",nthreads,write_percents[w],
+            (double)nthreads*thread_ops/elapsed);
+      }
+    }
+  }
+
+  hashtable_free(hashtbl);
+}
+
+void run_batches(int machine) {
+  hashtable *hashtbl;
+  int *keys;
+  void **out;
+  double start, single_time, many_time;
+  size_t found_single, found_many;
+  int e, f, i, n;
+  unsigned int seed = 1;
+
+  keys = (int *)malloc(batch_lookups*sizeof(int));
+  out = (void **)malloc(batch_lookups*sizeof(void *));
+  if(!keys || !out) {
+    fprintf(stderr,"Memory error\n");
+    exit(1);
+  }
+
+  if(machine) {
+    printf("config\tentries\tsingle_ns\tmany_ns\tspeedup\n");
+  }
+  else {
+    printf("%d random lookups, batches of %d\n",batch_lookups,batch_size);
+  }
+
+  for(e=0;e<NBATCH_ENTRIES;e++) {
+    for(f=0;f<2;f++) {
+      hashtbl = hashtable_create_flags(1024,inthash64,f ? HASHTABLE_OPEN : HASHTABLE_CHAINED);
+      if(!hashtbl || hashtable_reserve(hashtbl,batch_entries[e])<0) {
+        fprintf(stderr,"Table allocation error\n");
+        exit(1);
+      }
+      for(i=0;i<batch_entries[e];i++) {
+        if(hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i))<0) {
+          fprintf(stderr,"Insertion error at %d\n",i);
+          exit(1);
+        }
+      }
+      for(i=0;i<batch_lookups;i++) {
+        keys[i] = rand_r(&seed)%batch_entries[e];
+      }
+
+      found_single = 0;
+      start = now_us();
+      for(i=0;i<batch_lookups;i++) {
+        out[i] = hashtable_get(hashtbl,&keys[i],sizeof(int));
+        if(out[i]) found_single++;
+      }
+      single_time = now_us()-start;
+
+      found_many = 0;
+      start = now_us();
+      for(i=0;i<batch_lookups;i+=batch_size) {
+        n = batch_lookups-i<batch_size ? batch_lookups-i : batch_size;
+        found_many += hashtable_get_many(hashtbl,&keys[i],sizeof(int),&out[i],n);
+      }
+      many_time = now_us()-start;
+
+      if(found_single!=batch_lookups || found_many!=batch_lookups) {
+        fprintf(stderr,"Lookups missed keys\n");
+        exit(1);
+      }
+
+      if(machine) {
+        printf("%s\t%d\t%.2f\t%.2f\t%.2f\n",f ? "open" : "chained",batch_entries[e],
+            single_time*1e3/batch_lookups,many_time*1e3/batch_lookups,single_time/many_time);
+      }
+      else {
+        printf("%-8s %9d entries: single %6.1f ns, get_many %6.1f ns, %.2fx\n",f ? "open" : "chained",batch_entries[e],
+            single_time*1e3/batch_lookups,many_time*1e3/batch_lookups,single_time/many_time);
+      }
+      hashtable_free(hashtbl);
+    }
+  }
+
+  free(keys);
+  free(out);
+}
+
+void run_typed(int machine) {
+  hashtable *hashtbl;
+  intmap typed;
+  int *keys;
+  int *ip;
+  double start;
+  double generic[3], specialized[3];
+  double *times;
+  long sum;
+  int e, i, t, k;
+  unsigned int seed = 1;
+
+  keys = (int *)malloc(typed_lookups*sizeof(int));
+  if(!keys) {
+    fprintf(stderr,"Memory error\n");
+    exit(1);
+  }
+
+  if(machine) {
+    printf("entries\tgeneric_insert_ns\ttyped_insert_ns\tgeneric_hit_ns\ttyped_hit_ns\tgeneric_miss_ns\ttyped_miss_ns\n");
+  }
+  else {
+    printf("Int keys and values, %d random lookups, ns per operation\n",typed_lookups);
+  }
+
+  for(e=0;e<NTYPED_ENTRIES;e++) {
+    for(i=0;i<typed_lookups;i++) {
+      keys[i] = rand_r(&seed)%typed_entries[e];
+    }
+    sum = 0;
+
+    for(t=0;t<2;t++) {
+      times = t ? specialized : generic;
+      hashtbl = t ? NULL : hashtable_create_flags(16,inthash64,HASHTABLE_OPEN);
+      if(t ? intmap_init(&typed,16)<0 : !hashtbl) {
+        fprintf(stderr,"Table allocation error\n");
+        exit(1);
+      }
+
+      start = now_us();
+      for(i=0;i<typed_entries[e];i++) {
+        if((t ? intmap_insert(&typed,i,i) : hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i)))<0) {
+          fprintf(stderr,"Insertion error at %d\n",i);
+          exit(1);
+        }
+      }
+      times[0] = (now_us()-start)*1e3/typed_entries[e];
+
+      start = now_us();
+      for(i=0;i<typed_lookups;i++) {
+        ip = t ? intmap_get(&typed,keys[i]) : (int *)hashtable_get(hashtbl,&keys[i],sizeof(int));
+        sum += ip ? *ip : -1;
+      }
+      times[1] = (now_us()-start)*1e3/typed_lookups;
+
+      start = now_us();
+      for(i=0;i<typed_lookups;i++) {
+        k = keys[i]+typed_entries[e];
+        ip = t ? intmap_get(&typed,k) : (int *)hashtable_get(hashtbl,&k,sizeof(int));
+        sum += ip ? *ip : 0;
+      }
+      times[2] = (now_us()-start)*1e3/typed_lookups;
+
+      if(t) {
+        intmap_free(&typed);
+      }
+      else {
+        hashtable_free(hashtbl);
+      }
+    }
+
+    // Both tables see the same hits and no false ones
+    for(i=0;i<typed_lookups;i++) {
+      sum -= 2*(long)keys[i];
+    }
+    if(sum!=0) {
+      fprintf(stderr,"Lookups went wrong\n");
+      exit(1);
+    }
+
+    if(machine) {
+      printf("%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",typed_entries[e],generic[0],specialized[0],
+          generic[1],specialized[1],generic[2],specialized[2]);
+    }
+    else {
+      printf("%8d entries: insert %6.1f -> %6.1f, hit %6.1f -> %6.1f, miss %6.1f -> %6.1f\n",typed_entries[e],
+          generic[0],specialized[0],generic[1],specialized[1],generic[2],specialized[2]);
+    }
+  }
+
+  free(keys);
+}
+
+void run_upserts(int machine) {
+  hashtable *hashtbl;
+  struct upsert_count *found;
+  struct upsert_count update;
+  int *keys;
+  double start, get_insert_time, emplace_time;
+  size_t get_insert_allocs, emplace_allocs;
+  long total;
+  int e, f, i, t;
+  unsigned int seed = 1;
+
+  keys = (int *)malloc(upsert_ops*sizeof(int));
+  if(!keys) {
+    fprintf(stderr,"Memory error\n");
+    exit(1);
+  }
+
+  if(machine) {
+    printf("layout\tkeys\tget_insert_ns\templace_ns\tspeedup\tget_insert_allocs\templace_allocs\n");
+  }
+  else {
+    printf("%d counter updates, ns per update and mallocs\n",upsert_ops);
+  }
+
+  for(e=0;e<NUPSERT_KEYS;e++) {
+    for(i=0;i<upsert_ops;i++) {
+      keys[i] = rand_r(&seed)%upsert_keys[e];
+    }
+    for(f=0;f<2;f++) {
+      for(t=0;t<2;t++) {
+        hashtbl = hashtable_create_flags(1024,inthash64,f ? HASHTABLE_OPEN : HASHTABLE_CHAINED);
+        if(!hashtbl) {
+          fprintf(stderr,"Table allocation error\n");
+          exit(1);
+        }
+
+        start = now_us();
+        for(i=0;i<upsert_ops;i++) {
+          if(t) {
+            found = (struct upsert_count *)hashtable_emplace(hashtbl,&keys[i],sizeof(int),sizeof(struct upsert_count),NULL);
+            if(!found) {
+              fprintf(stderr,"Insertion error at %d\n",i);
+              exit(1);
+            }
+            if(found->count++==0) {
+              found->first = i;
+            }
+            found->last = i;
+          }
+          else {
+            found = (struct upsert_count *)hashtable_get(hashtbl,&keys[i],sizeof(int));
+            if(found) {
+              update = *found;
+            }
+            else {
+              memset(&update,0,sizeof(update));
+              update.first = i;
+            }
+            update.count++;
+            update.last = i;
+            if(hashtable_insert(hashtbl,&keys[i],sizeof(int),&update,sizeof(update))<0) {
+              fprintf(stderr,"Insertion error at %d\n",i);
+              exit(1);
+            }
+          }
+        }
+        if(t) {
+          emplace_time = now_us()-start;
+          emplace_allocs = hashtbl->allocations;
+        }
+        else {
+          get_insert_time = now_us()-start;
+          get_insert_allocs = hashtbl->allocations;
+        }
+
+        total = 0;
+        for(i=0;i<upsert_keys[e];i++) {
+          found = (struct upsert_count *)hashtable_get(hashtbl,&i,sizeof(int));
+          total += found ? found->count : 0;
+        }
+        if(total!=upsert_ops) {
+          fprintf(stderr,"Counts went wrong\n");
+          exit(1);
+        }
+        hashtable_free(hashtbl);
+      }
+
+      if(machine) {
+        printf("%s\t%d\t%.2f\t%.2f\t%.2f\t%zu\t%zu\n",f ? "open" : "chained",upsert_keys[e],get_insert_time*1e3/upsert_ops,
+            emplace_time*1e3/upsert_ops,get_insert_time/emplace_time,get_insert_allocs,emplace_allocs);
+      }
+      else {
+        printf("%-8s %8d keys: get+insert %6.1f ns, emplace %6.1f ns, %.2fx, mallocs %zu vs %zu\n",f ? "open" : "chained",upsert_keys[e],
+            get_insert_time*1e3/upsert_ops,emplace_time*1e3/upsert_ops,get_insert_time/emplace_time,get_insert_allocs,emplace_allocs);
+      }
+    }
+  }
+
+  free(keys);
+}
+
+void run_snapshots(int machine) {
+  hashtable *hashtbl;
+  hashtable *mapped;
+  int *keys;
+  uint64_t value[2];
+  double start, build_time, write_time, map_time, validate_time, built_get, mapped_get;
+  long file_kb;
+  size_t found;
+  int e, i;
+  unsigned int seed = 1;
+
+  keys = (int *)malloc(snapshot_lookups*sizeof(int));
+  if(!keys) {
+    fprintf(stderr,"Memory error\n");
+    exit(1);
+  }
+
+  if(machine) {
+    printf("entries\tbuild_ms\twrite_ms\tfile_kb\tmap_us\tvalidate_ms\tbuilt_get_ns\tmapped_get_ns\n");
+  }
+  else {
+    printf("Int keys and 16 byte values, %d random lookups\n",snapshot_lookups);
+  }
+
+  for(e=0;e<NSNAPSHOT_ENTRIES;e++) {
+    start = now_us();
+    hashtbl = hashtable_create_flags(1024,inthash64,HASHTABLE_OPEN);
+    if(!hashtbl) {
+      fprintf(stderr,"Table allocation error\n");
+      exit(1);
+    }
+    for(i=0;i<snapshot_entries[e];i++) {
+      value[0] = i;
+      value[1] = ~(uint64_t)i;
+      if(hashtable_insert(hashtbl,&i,sizeof(i),value,sizeof(value))<0) {
+        fprintf(stderr,"Insertion error at %d\n",i);
+        exit(1);
+      }
+    }
+    build_time = now_us()-start;
+
+    start = now_us();
+    if(hashtable_snapshot(hashtbl,snapshot_path)<0) {
+      fprintf(stderr,"Unable to write %s\n",snapshot_path);
+      exit(1);
+    }
+    write_time = now_us()-start;
+
+    start = now_us();
+    mapped = hashtable_map(snapshot_path,inthash64,0);
+    map_time = now_us()-start;
+    if(!mapped) {
+      fprintf(stderr,"Unable to map %s\n",snapshot_path);
+      exit(1);
+    }
+    file_kb = mapped->map_size/1024;
+    hashtable_free(mapped);
+
+    start = now_us();
+    mapped = hashtable_map(snapshot_path,inthash64,1);
+    validate_time = now_us()-start;
+    if(!mapped) {
+      fprintf(stderr,"%s failed validation\n",snapshot_path);
+      exit(1);
+    }
+
+    for(i=0;i<snapshot_lookups;i++) {
+      keys[i] = rand_r(&seed)%snapshot_entries[e];
+    }
+    found = 0;
+    start = now_us();
+    for(i=0;i<snapshot_lookups;i++) {
+      if(hashtable_get(hashtbl,&keys[i],sizeof(int))) found++;
+    }
+    built_get = now_us()-start;
+    start = now_us();
+    for(i=0;i<snapshot_lookups;i++) {
+      if(hashtable_get(mapped,&keys[i],sizeof(int))) found++;
+    }
+    mapped_get = now_us()-start;
+    if(found!=2*(size_t)snapshot_lookups) {
+      fprintf(stderr,"Lookups missed keys\n");
+      exit(1);
+    }
+
+    if(machine) {
+      printf("%d\t%.2f\t%.2f\t%ld\t%.1f\t%.2f\t%.2f\t%.2f\n",snapshot_entries[e],build_time/1e3,write_time/1e3,file_kb,
+          map_time,validate_time/1e3,built_get*1e3/snapshot_lookups,mapped_get*1e3/snapshot_lookups);
+    }
+    else {
+      printf("%8d entries: build %8.2f ms, write %8.2f ms (%ld KiB), map %6.1f us, validate %8.2f ms, get %5.1f ns built, %5.1f ns mapped\n",
+          snapshot_entries[e],build_time/1e3,write_time/1e3,file_kb,map_time,validate_time/1e3,
+          built_get*1e3/snapshot_lookups,mapped_get*1e3/snapshot_lookups);
+    }
+    hashtable_free(mapped);
+    hashtable_free(hashtbl);
+  }
+
+  remove(snapshot_path);
+  free(keys);
+}
+
+void run_freezes(int machine) {
+  hashtable *chained;
+  hashtable *open;
+  hashtable *frozen;
+  struct hashtable_stats open_stats, frozen_stats;
+  int *hits;
+  int *misses;
+  uint64_t value[2];
+  double start, build_time, freeze_time;
+  double chained_get, open_get, frozen_get, open_miss, frozen_miss;
+  int e, i;
+  unsigned int seed = 1;
+
+  hits = (int *)malloc(freeze_lookups*sizeof(int));
+  misses = (int *)malloc(freeze_lookups*sizeof(int));
+  if(!hits || !misses) {
+    fprintf(stderr,"Memory error\n");
+    exit(1);
+  }
+
+  if(machine) {
+    printf("entries\tbuild_ms\tfreeze_ms\topen_kb\tfrozen_kb\tchained_get_ns\topen_get_ns\tfrozen_get_ns\topen_miss_ns\tfrozen_miss_ns\n");
+  }
+  else {
+    printf("Int keys and 16 byte values, %d random hits and misses\n",freeze_lookups);
+  }
+
+  for(e=0;e<NFREEZE_ENTRIES;e++) {
+    chained = hashtable_create_flags(1024,inthash64,HASHTABLE_CHAINED);
+    open = hashtable_create_flags(1024,inthash64,HASHTABLE_OPEN);
+    if(!chained || !open) {
+      fprintf(stderr,"Table allocation error\n");
+      exit(1);
+    }
+    start = now_us();
+    for(i=0;i<freeze_entries[e];i++) {
+      value[0] = i;
+      value[1] = ~(uint64_t)i;
+      if(hashtable_insert(open,&i,sizeof(i),value,sizeof(value))<0) {
+        fprintf(stderr,"Insertion error at %d\n",i);
+        exit(1);
+      }
+    }
+    build_time = now_us()-start;
+    for(i=0;i<freeze_entries[e];i++) {
+      value[0] = i;
+      value[1] = ~(uint64_t)i;
+      if(hashtable_insert(chained,&i,sizeof(i),value,sizeof(value))<0) {
+        fprintf(stderr,"Insertion error at %d\n",i);
+        exit(1);
+      }
+    }
+
+    start = now_us();
+    frozen = hashtable_freeze(open);
+    freeze_time = now_us()-start;
+    if(!frozen) {
+      fprintf(stderr,"Unable to freeze %d entries\n",freeze_entries[e]);
+      exit(1);
+    }
+    hashtable_stats(open,&open_stats);
+    hashtable_stats(frozen,&frozen_stats);
+
+    for(i=0;i<freeze_lookups;i++) {
+      hits[i] = rand_r(&seed)%freeze_entries[e];
+      misses[i] = freeze_entries[e]+rand_r(&seed)%freeze_entries[e];
+    }
+    chained_get = time_gets(chained,hits,freeze_lookups,freeze_lookups);
+    open_get = time_gets(open,hits,freeze_lookups,freeze_lookups);
+    frozen_get = time_gets(frozen,hits,freeze_lookups,freeze_lookups);
+    open_miss = time_gets(open,misses,freeze_lookups,0);
+    frozen_miss = time_gets(frozen,misses,freeze_lookups,0);
+
+    if(machine) {
+      printf("%d\t%.2f\t%.2f\t%zu\t%zu\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",freeze_entries[e],build_time/1e3,freeze_time/1e3,
+          open_stats.bytes/1024,frozen_stats.bytes/1024,chained_get,open_get,frozen_get,open_miss,frozen_miss);
+    }
+    else {
+      printf("%8d entries: build %8.2f ms, freeze %8.2f ms, %7zu KiB open, %7zu KiB frozen\n",
+          freeze_entries[e],build_time/1e3,freeze_time/1e3,open_stats.bytes/1024,frozen_stats.bytes/1024);
+      printf("%17s get %5.1f ns chained, %5.1f ns open, %5.1f ns frozen, miss %5.1f ns open, %5.1f ns frozen\n",
+          "",chained_get,open_get,frozen_get,open_miss,frozen_miss);
+    }
+    hashtable_free(frozen);
+    hashtable_free(open);
+    hashtable_free(chained);
+  }
+
+  free(hits);
+  free(misses);
+}
+
+/* Nanoseconds per hashtable_get of n int keys, of which expect must be
+ * found. */
+double time_gets(hashtable *hashtbl, int *keys, int n, size_t expect) {
+  double start;
+  size_t found = 0;
+  int i;
+
+  start = now_us();
+  for(i=0;i<n;i++) {
+    if(hashtable_get(hashtbl,&keys[i],sizeof(int))) found++;
+  }
+  start = now_us()-start;
+  if(found!=expect) {
+    fprintf(stderr,"Lookups found %zu keys rather than %zu\n",found,expect);
+    exit(1);
+  }
+  return start*1e3/n;
+}
+
+void run_suite(int max_entries, int machine) {
+  int e, k, d, f;
+
+  if(machine) {
+    printf("layout\tkey_size\tdist\tentries");
+    for(f=0;f<NSUITE_OPS;f++) {
+      printf("\t%s_mops",suite_op_names[f]);
+    }
+    printf("\tload\tmax_length\tbytes_per_entry\n");
+  }
+  else {
+    printf("Million operations per second; max length and bytes per entry from hashtable_stats\n");
+    printf("%-8s %4s %-6s %8s","layout","key","dist","entries");
+    for(f=0;f<NSUITE_OPS;f++) {
+      printf(" %8s",suite_op_names[f]);
+    }
+    printf(" %5s %3s %6s\n","load","max","bytes");
+  }
+  fflush(stdout);
+
+  for(e=0;e<NSUITE_ENTRIES && suite_entries[e]<=max_entries;e++) {
+    for(k=0;k<NSUITE_KEY_SIZES;k++) {
+      for(d=0;d<2;d++) {
+        for(f=0;f<2;f++) {
+          run_suite_config(f ? HASHTABLE_OPEN : HASHTABLE_CHAINED,suite_key_sizes[k],d,suite_entries[e],machine);
+        }
+      }
+    }
+  }
+}
+
+void run_suite_config(int flags, size_t key_size, int dist, int entries, int machine) {
+  hashtable *hashtbl;
+  hashtable_iterator *iterator;
+  struct hashtable_stats stats;
+  uint8_t key[64];
+  double times[NSUITE_OPS];
+  double start;
+  long done, visited;
+  int reps, r, i, op;
+  size_t found;
+
+  memset(times,0,sizeof(times));
+  reps = (suite_ops+entries-1)/entries;
+  found = 0;
+
+  for(r=0;r<reps;r++) {
+    hashtbl = hashtable_create_flags(16,mulmix64,flags);
+    if(!hashtbl) {
+      fprintf(stderr,"Table allocation error\n");
+      exit(1);
+    }
+
+    start = now_us();
+    for(i=0;i<entries;i++) {
+      suite_key(key,key_size,dist,i);
+      if(hashtable_insert(hashtbl,key,key_size,&i,sizeof(i))<0) {
+        fprintf(stderr,"Insertion error at %d\n",i);
+        exit(1);
+      }
+    }
+    times[OP_INSERT] += now_us()-start;
+
+    // Visit the keys out of order, so big tables miss the cache
+    start = now_us();
+    for(i=0;i<entries;i++) {
+      suite_key(key,key_size,dist,(uint64_t)i*UINT64_C(2654435761)%entries);
+      if(hashtable_get(hashtbl,key,key_size)) {
+        found++;
+      }
+    }
+    times[OP_HIT] += now_us()-start;
+
+    start = now_us();
+    for(i=0;i<entries;i++) {
+      suite_key(key,key_size,dist,entries+(uint64_t)i*UINT64_C(2654435761)%entries);
+      if(hashtable_get(hashtbl,key,key_size)) {
+        found--;
+      }
+    }
+    times[OP_MISS] += now_us()-start;
+
+    start = now_us();
+    done = 0;
+    iterator = hashtable_iterator_create(hashtbl);
+    hashtable_iterator_next(iterator);
+    while(hashtable_iterator_get_key(iterator)!=NULL) {
+      done++;
+      hashtable_iterator_next(iterator);
+    }
+    hashtable_iterator_free(iterator);
+    times[OP_ITERATE] += now_us()-start;
+
+    start = now_us();
+    visited = 0;
+    hashtable_foreach(hashtbl,suite_visit,&visited);
+    times[OP_FOREACH] += now_us()-start;
+    if(visited!=entries) {
+      found--;
+    }
+
+    if(r==reps-1) {
+      hashtable_stats(hashtbl,&stats);
+    }
+
+    start = now_us();
+    for(i=0;i<entries;i++) {
+      suite_key(key,key_size,dist,i);
+      if(hashtable_remove(hashtbl,key,key_size)<0) {
+        found--;
+      }
+    }
+    times[OP_REMOVE] += now_us()-start;
+
+    if(done!=entries) {
+      found--;
+    }
+    hashtable_free(hashtbl);
+  }
+
+  if(found!=(size_t)reps*entries) {
+    fprintf(stderr,"Lookups went wrong for %d entries\n",entries);
+    exit(1);
+  }
+
+  if(machine) {
+    printf("%s\t%zu\t%s\t%d",flags&HASHTABLE_OPEN ? "open" : "chained",key_size,suite_dists[dist],entries);
+    for(op=0;op<NSUITE_OPS;op++) {
+      printf("\t%.3f",(double)reps*entries/times[op]);
+    }
+    printf("\t%.3f\t%zu\t%.1f\n",stats.load,stats.max_length,(double)stats.bytes/entries);
+  }
+  else {
+    printf("%-8s %4zu %-6s %8d",flags&HASHTABLE_OPEN ? "open" : "chained",key_size,suite_dists[dist],entries);
+    for(op=0;op<NSUITE_OPS;op++) {
+      printf(" %8.2f",(double)reps*entries/times[op]);
+    }
+    printf(" %5.2f %3zu %6.1f\n",stats.load,stats.max_length,(double)stats.bytes/entries);
+  }
+  fflush(stdout);
+}
+
+/* Sequential keys hold the index in their first bytes, random ones a
+ * scrambled index, and the rest of the key is zero either way. Both
+ * scramblers are one to one, so distinct indexes stay distinct keys. */
+void suite_key(uint8_t *key, size_t key_size, int dist, uint64_t i) {
+  uint64_t v = i;
+  uint32_t v32;
+
+  memset(key,0,key_size);
+  if(key_size<sizeof(v)) {
+    v32 = (uint32_t)i;
+    if(dist) {
+      v32 ^= v32>>16;
+      v32 *= UINT32_C(0x7feb352d);
+      v32 ^= v32>>15;
+      v32 *= UINT32_C(0x846ca68b);
+      v32 ^= v32>>16;
+    }
+    memcpy(key,&v32,key_size<sizeof(v32) ? key_size : sizeof(v32));
+  }
+  else {
+    if(dist) {
+      v = splitmix64(i);
+    }
+    memcpy(key,&v,sizeof(v));
+  }
+}
+
+int suite_visit(void *key, size_t key_size, void *data, size_t data_size, void *ctx) {
+  (*(long *)ctx)++;
+  return 0;
+}
+
+uint64_t splitmix64(uint64_t x) {
+  x += UINT64_C(0x9e3779b97f4a7c15);
+  x = (x^(x>>30))*UINT64_C(0xbf58476d1ce4e5b9);
+  x = (x^(x>>27))*UINT64_C(0x94d049bb133111eb);
+  return x^(x>>31);
+}
+
+void *thread_ops_loop(void *arg) {
+  struct thread_config *config = (struct thread_config *)arg;
+  int key, value;
+  int i;
+
+  pthread_barrier_wait(config->start);
+
+  for(i=0;i<thread_ops;i++) {
+    key = rand_r(&config->seed)%thread_keys;
+    if(rand_r(&config->seed)%100<config->write_percent) {
+      hashtable_insert(config->hashtbl,&key,sizeof(key),&i,sizeof(i));
+    }
+    else {
+      hashtable_get_copy(config->hashtbl,&key,sizeof(key),&value,sizeof(value));
+    }
+  }
+
+  return NULL;
+}
+
+double now_us() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec*1e6+t.tv_nsec/1e3;
+}
+
+long resident_kb() {
+  FILE *statm;
+  long size, resident;
+
+  statm = fopen("/proc/self/statm","r");
+  if(!statm) {
+    return 0;
+  }
+  if(fscanf(statm,"%ld %ld",&size,&resident)!=2) {
+    resident = 0;
+  }
+  fclose(statm);
+
+  return resident*(sysconf(_SC_PAGESIZE)/1024);
+}
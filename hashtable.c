@@ -2,10 +2,322 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 const uint64_t fnv64_prime = UINT64_C(1099511628211);
 const uint64_t fnv64_offset = UINT64_C(14695981039346656037);
 
+/* Odd constants for mulmix64, from the fractional parts of sqrt(2), sqrt(3)
+ * and the golden ratio. */
+static const uint64_t mix_k0 = UINT64_C(0x6a09e667f3bcc909);
+static const uint64_t mix_k1 = UINT64_C(0xbb67ae8584caa73b);
+static const uint64_t mix_k2 = UINT64_C(0x9e3779b97f4a7c15);
+
+/* Control bytes for HASHTABLE_OPEN. A full slot holds the low seven bits
+ * of its key's hash, empty and deleted slots have the high bit set. The
+ * first GROUP_WIDTH bytes are repeated after the end of the array so a
+ * group can be loaded from any slot without wrapping. */
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+#define GROUP_WIDTH 16
+#define MIN_CAPACITY 16
+#define NOT_FOUND ((size_t)-1)
+
+/* Default and largest loads, and how much of the old array each call moves
+ * during a resize. Open tables move more per call since only inserts and
+ * removes help, and an open resize has to finish before the new array
+ * fills up. */
+#define CHAINED_LOAD 1.0
+#define OPEN_LOAD 0.875
+#define REHASH_BUCKETS 4
+#define REHASH_SLOTS 16
+
+/* How far ahead of the lookups hashtable_get_many prefetches, and the size
+ * of its ring of hashes, which must hold more than 2*GET_MANY_AHEAD. */
+#define GET_MANY_AHEAD 8
+#define GET_MANY_RING 32
+
+/* HASHTABLE_POOL carves keys, data and chain nodes out of large slabs, with
+ * a free list for each multiple of POOL_GRAIN bytes up to POOL_MAX. Bigger
+ * blocks come from malloc but are linked into the pool so the whole pool
+ * can be released without looking at the entries. */
+#define POOL_GRAIN 16
+#define POOL_MAX 256
+#define POOL_CLASSES (POOL_MAX/POOL_GRAIN)
+#define POOL_SLAB 65536
+
+struct pool_block {
+  struct pool_block *next;
+};
+
+/* Header of a slab or of a large block, padded to keep the rest aligned. */
+struct pool_chunk {
+  struct pool_chunk *prev;
+  struct pool_chunk *next;
+};
+
+struct hashpool {
+  struct pool_block *free[POOL_CLASSES];
+  uint8_t *slab_pos;
+  size_t slab_left;
+  struct pool_chunk *slabs;
+  struct pool_chunk large;
+  size_t bytes; /* slabs and large blocks */
+};
+
+/* HASHTABLE_CONCURRENT keeps the chained layout but never changes a node
+ * once readers can see it. Writers lock one of SYNC_STRIPES mutexes chosen
+ * by the hash, and since the bucket count stays a multiple of SYNC_STRIPES
+ * each bucket always falls under the same stripe. Readers take no locks.
+ * Unlinked nodes are freed in batches once every reader that might still
+ * hold one has left: each reader counts itself in one of two halves
+ * picked by the low bit of the epoch, and freeing flips the epoch and
+ * waits for the old half to drain, twice, so late arrivals are covered. The
+ * reader counts are spread over padded slots so readers on different
+ * threads don't fight over one cache line. A resize takes every stripe and
+ * moves nodes to the new array while readers run, so a lookup that misses
+ * during a resize tries again. A thread that writes from inside its own
+ * read section would wait for itself, so then the nodes and old bucket
+ * arrays it unlinks stay queued until a write outside any section. */
+#define SYNC_STRIPES 16
+#define SYNC_READER_SLOTS 16
+#define SYNC_RETIRE_BATCH 256
+#define CACHE_LINE 64
+
+struct sync_stripe {
+  pthread_mutex_t lock;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct sync_readers {
+  unsigned long count[2];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct hashsync {
+  struct sync_stripe stripes[SYNC_STRIPES];
+  struct sync_readers readers[SYNC_READER_SLOTS];
+  unsigned long epoch;
+  unsigned long resizing; /* odd while a resize is moving nodes */
+  pthread_mutex_t retire_lock; /* also serializes waiting for readers */
+  struct hashnode **retired;
+  size_t nretired;
+  size_t retired_size;
+  struct hashnode ***stale; /* old bucket arrays waiting for readers */
+  size_t nstale;
+  size_t stale_size;
+};
+
+/* A snapshot file holds a header, the control bytes and the slots of an
+ * open table, then the entries. A slot holds the hash and the offset of its
+ * entry from the start of the file, so the file can be mapped at any
+ * address, and an entry holds the sizes followed by the key and then the
+ * data, each padded to a multiple of SNAPSHOT_ALIGN bytes. The
+ * header records the byte order, as the numbers are written as they are
+ * in memory, a hash of SNAPSHOT_CHECK to catch a different hash function
+ * and a checksum of everything after the header for the validation. */
+#define SNAPSHOT_MAGIC "hashsnap"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER UINT64_C(0x0102030405060708)
+#define SNAPSHOT_CHECK "blinky-tetris hashtable"
+#define SNAPSHOT_ALIGN 8
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t slot_size;
+  uint64_t byte_order;
+  uint64_t file_size;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t hash_check;
+  uint64_t ctrl_offset;
+  uint64_t slots_offset;
+  uint64_t blob_offset;
+  uint64_t checksum; /* mulmix64 of the rest of the file */
+};
+
+struct snapshot_slot {
+  uint64_t hash;
+  uint64_t entry_offset;
+};
+
+struct snapshot_entry {
+  uint64_t key_size;
+  uint64_t data_size;
+};
+
+/* A frozen table is built by hash and displace. Keys are split by hash into
+ * buckets of about FROZEN_BUCKET_KEYS, and each bucket gets the first seed
+ * that sends all of its keys to free slots, out of n+n/FROZEN_SLACK+1.
+ * A lookup takes the seed of its bucket to find its slot. The entries sit
+ * in an array of n, so an entry whose slot is below n is at that slot, and
+ * the few above n are moved into the gaps left below n, with remap saying
+ * where. That keeps lookups to two dependent loads, the seed and the entry,
+ * for all but the keys that landed in the spare slots. */
+#define FROZEN_BUCKET_KEYS 3
+#define FROZEN_SLACK 16
+#define FROZEN_MAX_SEED 65535
+
+struct hashfrozen {
+  size_t buckets;
+  size_t slots;
+  uint16_t *seeds;
+  size_t *remap; /* where slot n+i's entry lives */
+};
+
+static __thread int reader_slot = -1;
+static unsigned int snapshot_serial; /* keeps temporary snapshot names apart */
+static __thread int reader_depth; /* read sections this thread is in */
+static unsigned int next_reader_slot;
+
+/* A group_mask has a bit set for each control byte in a group that matched.
+ * NEON has no movemask, so there each byte gets four bits. */
+typedef uint64_t group_mask;
+
+#if defined(__SSE2__)
+#define GROUP_SHIFT 0
+
+static inline group_mask group_match(const uint8_t *ctrl, uint8_t h) {
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (group_mask)_mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8((char)h)));
+}
+
+static inline group_mask group_match_free(const uint8_t *ctrl) {
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (group_mask)_mm_movemask_epi8(group);
+}
+
+static inline group_mask group_match_full(const uint8_t *ctrl) {
+  return group_match_free(ctrl)^0xffff;
+}
+#elif defined(__ARM_NEON)
+#define GROUP_SHIFT 2
+
+static inline group_mask neon_mask(uint8x16_t matches) {
+  uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches),4);
+  return vget_lane_u64(vreinterpret_u64_u8(narrowed),0) & UINT64_C(0x8888888888888888);
+}
+
+static inline group_mask group_match(const uint8_t *ctrl, uint8_t h) {
+  return neon_mask(vceqq_u8(vld1q_u8(ctrl),vdupq_n_u8(h)));
+}
+
+static inline group_mask group_match_free(const uint8_t *ctrl) {
+  return neon_mask(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(ctrl)),vdupq_n_s8(0)));
+}
+
+static inline group_mask group_match_full(const uint8_t *ctrl) {
+  return neon_mask(vcgeq_s8(vreinterpretq_s8_u8(vld1q_u8(ctrl)),vdupq_n_s8(0)));
+}
+#else
+#define GROUP_SHIFT 0
+
+static inline group_mask group_match(const uint8_t *ctrl, uint8_t h) {
+  group_mask mask = 0;
+  int i;
+
+  for(i=0;i<GROUP_WIDTH;i++) {
+    if(ctrl[i]==h) mask |= (group_mask)1<<i;
+  }
+  return mask;
+}
+
+static inline group_mask group_match_free(const uint8_t *ctrl) {
+  group_mask mask = 0;
+  int i;
+
+  for(i=0;i<GROUP_WIDTH;i++) {
+    if(ctrl[i]&0x80) mask |= (group_mask)1<<i;
+  }
+  return mask;
+}
+
+static inline group_mask group_match_full(const uint8_t *ctrl) {
+  group_mask mask = 0;
+  int i;
+
+  for(i=0;i<GROUP_WIDTH;i++) {
+    if(!(ctrl[i]&0x80)) mask |= (group_mask)1<<i;
+  }
+  return mask;
+}
+#endif
+
+#define group_first(mask) ((size_t)(__builtin_ctzll(mask)>>GROUP_SHIFT))
+
+/* Stands in for the data of entries inserted with a data_size of 0, so that
+ * hashtable_get still finds them. */
+static uint8_t empty_data;
+
+static void *entry_alloc(hashtable *hashtbl, size_t size);
+static void entry_free(hashtable *hashtbl, void *ptr, size_t size);
+static void pool_free(struct hashpool *pool);
+
+static inline void *node_key(struct hashnode *node);
+static inline void *node_data(struct hashnode *node);
+static int node_set_key(hashtable *hashtbl, struct hashnode *node, void *key, size_t key_size, uint64_t hash);
+static int node_set_data(hashtable *hashtbl, struct hashnode *node, void *data, size_t data_size, int copy);
+static void node_release(hashtable *hashtbl, struct hashnode *node);
+static size_t node_bytes(struct hashnode *node);
+static int node_resize_data(hashtable *hashtbl, struct hashnode *node, size_t data_size);
+static int table_put(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size, int copy, uint64_t hash, struct hashnode **out, int *inserted);
+static int table_found(hashtable *hashtbl, struct hashnode *node, void *data, size_t data_size, int copy, struct hashnode **out, int *inserted);
+static void table_set_size(hashtable *hashtbl, size_t size);
+static void rehash_finish(hashtable *hashtbl);
+
+static int chain_alloc(hashtable *hashtbl, size_t size);
+static int chain_start_resize(hashtable *hashtbl, size_t size);
+static void chain_move_bucket(hashtable *hashtbl, size_t pos);
+static void chain_rehash(hashtable *hashtbl, size_t buckets);
+static void chain_free_nodes(hashtable *hashtbl, struct hashnode **nodearray, size_t size);
+static void open_free_nodes(hashtable *hashtbl, uint8_t *ctrl, struct hashnode *slots, size_t size);
+
+static int open_alloc(hashtable *hashtbl, size_t capacity);
+static int open_start_resize(hashtable *hashtbl, size_t capacity);
+static void open_rehash(hashtable *hashtbl, size_t slots);
+static void open_set_ctrl(uint8_t *ctrl, size_t capacity, size_t slot, uint8_t c);
+static size_t open_find(uint8_t *ctrl, struct hashnode *slots, size_t capacity, uint64_t hash, void *key, size_t key_size);
+static size_t open_find_free(uint8_t *ctrl, size_t capacity, uint64_t hash);
+static size_t open_capacity(hashtable *hashtbl, size_t count);
+static int open_make_room(hashtable *hashtbl);
+
+static uint64_t snapshot_align(uint64_t offset);
+static int snapshot_pad(FILE *file, uint64_t size);
+static int snapshot_sum(const char *path);
+static int snapshot_check(struct snapshot_header *header, size_t file_size, uint64_t (*hashfunc)(void *, size_t));
+static size_t map_find(hashtable *hashtbl, uint64_t hash, void *key, size_t key_size);
+static int map_validate(hashtable *hashtbl);
+static inline struct snapshot_entry *map_entry(hashtable *hashtbl, size_t slot);
+static inline void *map_key(struct snapshot_entry *entry);
+static inline void *map_data(struct snapshot_entry *entry);
+static struct snapshot_entry *map_iterator_entry(hashtable_iterator *iterator);
+
+static inline size_t frozen_range(uint64_t hash, size_t n);
+static inline size_t frozen_slot(uint64_t hash, uint16_t seed, size_t slots);
+static inline size_t frozen_find(hashtable *hashtbl, uint64_t hash, void *key, size_t key_size);
+static int frozen_build(struct hashfrozen *frozen, uint64_t *hashes, size_t n, size_t *slot_of);
+
+static struct hashsync *sync_create(void);
+static void sync_free(hashtable *hashtbl);
+static void sync_wait_readers(struct hashsync *sync);
+static void sync_reclaim(hashtable *hashtbl);
+static void sync_retire(hashtable *hashtbl, struct hashnode *node);
+static int sync_grow(hashtable *hashtbl, size_t size);
+static int sync_put(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size, int copy, uint64_t hash);
+static int sync_remove(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash);
+static void sync_clear(hashtable *hashtbl);
+static struct hashnode *sync_find(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash);
+
 uint64_t fnv1a64(void *buf, size_t len) {
   uint8_t *pointer = (uint8_t *)buf;
   uint8_t *buf_end = pointer+len;
@@ -19,26 +331,177 @@ uint64_t fnv1a64(void *buf, size_t len) {
   return hash;
 }
 
+/* Multiplies two words to 128 bits and folds the halves together, which
+ * mixes every input bit into every output bit in one multiply. */
+static inline uint64_t mix_fold(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t product = (__uint128_t)a*b;
+  return (uint64_t)product^(uint64_t)(product>>64);
+#else
+  uint64_t lo, hi, mid;
+  uint64_t a_lo = (uint32_t)a, a_hi = a>>32;
+  uint64_t b_lo = (uint32_t)b, b_hi = b>>32;
+
+  lo = a_lo*b_lo;
+  mid = a_hi*b_lo+(lo>>32);
+  hi = a_hi*b_hi+(mid>>32);
+  mid = (uint32_t)mid+a_lo*b_hi;
+  hi += mid>>32;
+  lo = (mid<<32)|(uint32_t)lo;
+  return lo^hi;
+#endif
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+/* Reads 16 bytes per round and folds each pair of words with one wide
+ * multiply. The tail is read as two overlapping pieces so every length
+ * takes a single step rather than a byte loop, and keys of up to 8 bytes
+ * need only one multiply. */
+uint64_t mulmix64(void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+  uint64_t seed = mix_k2^len;
+  uint64_t a, b;
+  size_t left = len;
+
+  while(left>16) {
+    seed = mix_fold(read64(p)^mix_k0,read64(p+8)^seed);
+    p += 16;
+    left -= 16;
+  }
+
+  if(left>8) {
+    a = read64(p);
+    b = read64(p+left-8);
+    return mix_fold(mix_k1^len,mix_fold(a^mix_k0,b^seed));
+  }
+
+  if(left>=4) {
+    a = (read32(p)<<32)|read32(p+left-4);
+  }
+  else if(left>0) {
+    a = ((uint64_t)p[0]<<16)|((uint64_t)p[left>>1]<<8)|p[left-1];
+  }
+  else {
+    a = 0;
+  }
+  return mix_fold(a^seed,mix_k1);
+}
+
+/* For keys that are 4 or 8 byte integers: the murmur3 finalizer, which
+ * scatters sequential integers over all 64 bits. Other lengths fall back
+ * to mulmix64. */
+uint64_t inthash64(void *buf, size_t len) {
+  uint64_t h;
+
+  if(len==8) {
+    h = read64((const uint8_t *)buf);
+  }
+  else if(len==4) {
+    h = read32((const uint8_t *)buf);
+  }
+  else {
+    return mulmix64(buf,len);
+  }
+
+  h ^= h>>33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h>>33;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h>>33;
+  return h;
+}
+
 hashtable *hashtable_create(size_t size, uint64_t (*hashfunc)(void *, size_t)) {
+  return hashtable_create_flags(size,hashfunc,HASHTABLE_CHAINED);
+}
+
+hashtable *hashtable_create_flags(size_t size, uint64_t (*hashfunc)(void *, size_t), int flags) {
   hashtable *hashtbl;
-  int i;
+  size_t capacity;
+
+  /* Only hashtable_map and hashtable_freeze make these. */
+  if(flags&(HASHTABLE_MAPPED|HASHTABLE_FROZEN)) {
+    return NULL;
+  }
 
   hashtbl = (hashtable *)malloc(sizeof(hashtable));
   if(!hashtbl) {
     return NULL;
   }
 
-  hashtbl->nodearray = (struct hashnode**)malloc(size*sizeof(struct hashnode*));
-  if(!hashtbl->nodearray) {
-    free(hashtbl);
-    return NULL;
+  hashtbl->flags=flags;
+  hashtbl->count=0;
+  hashtbl->deleted=0;
+  hashtbl->nodearray=NULL;
+  hashtbl->ctrl=NULL;
+  hashtbl->slots=NULL;
+  hashtbl->old_nodearray=NULL;
+  hashtbl->old_ctrl=NULL;
+  hashtbl->old_slots=NULL;
+  hashtbl->old_size=0;
+  hashtbl->rehash_pos=0;
+  hashtbl->pool=NULL;
+  hashtbl->allocations=0;
+  hashtbl->sync=NULL;
+  hashtbl->map=NULL;
+  hashtbl->map_size=0;
+  hashtbl->map_slots=NULL;
+  hashtbl->frozen=NULL;
+
+  if(flags&HASHTABLE_CONCURRENT) {
+    if(flags&(HASHTABLE_OPEN|HASHTABLE_POOL)) {
+      free(hashtbl);
+      return NULL;
+    }
+    size = (size+SYNC_STRIPES-1)/SYNC_STRIPES*SYNC_STRIPES;
   }
 
-  for(i=0;i<size;i++) {
-    hashtbl->nodearray[i]=NULL;
+  if(flags&HASHTABLE_POOL) {
+    hashtbl->pool = (struct hashpool *)calloc(1,sizeof(struct hashpool));
+    if(!hashtbl->pool) {
+      free(hashtbl);
+      return NULL;
+    }
   }
-  
-  hashtbl->size=size;
+
+  if(flags&HASHTABLE_OPEN) {
+    hashtbl->max_load=OPEN_LOAD;
+    for(capacity=MIN_CAPACITY;capacity<size;capacity*=2);
+    if(open_alloc(hashtbl,capacity)<0) {
+      free(hashtbl->pool);
+      free(hashtbl);
+      return NULL;
+    }
+  }
+  else {
+    hashtbl->max_load=CHAINED_LOAD;
+    if(size==0 || chain_alloc(hashtbl,size)<0) {
+      free(hashtbl->pool);
+      free(hashtbl);
+      return NULL;
+    }
+  }
+
+  if(flags&HASHTABLE_CONCURRENT) {
+    hashtbl->sync = sync_create();
+    if(!hashtbl->sync) {
+      free(hashtbl->nodearray);
+      free(hashtbl);
+      return NULL;
+    }
+  }
+
   if(hashfunc) {
     hashtbl->hashfunc=hashfunc;
   }
@@ -49,138 +512,125 @@ hashtable *hashtable_create(size_t size, uint64_t (*hashfunc)(void *, size_t)) {
   return hashtbl;
 }
 
+uint64_t hashtable_hash(hashtable *hashtbl, void *key, size_t key_size) {
+  return hashtbl->hashfunc(key,key_size);
+}
+
 int hashtable_insert(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size) {
-  struct hashnode *curr_node;
-  size_t hashpos;
-  size_t olddata_size;
-  void *olddata;
+  return table_put(hashtbl,key,key_size,data,data_size,1,hashtbl->hashfunc(key,key_size),NULL,NULL);
+}
 
-  hashpos = hashtbl->hashfunc(key,key_size)%hashtbl->size;
+int hashtable_insert_prehashed(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size, uint64_t hash) {
+  return table_put(hashtbl,key,key_size,data,data_size,1,hash,NULL,NULL);
+}
 
-  curr_node = hashtbl->nodearray[hashpos];
-  while(curr_node) {
-    if(key_size==curr_node->key_size) {
-      if(memcmp(key,curr_node->key,key_size)==0) {
-        olddata = curr_node->data;
-        olddata_size = curr_node->data_size;
-
-        curr_node->data_size=data_size;
-        curr_node->data = malloc(data_size);
-        
-        if(!curr_node->data) {
-          curr_node->data_size=olddata_size;
-          curr_node->data=olddata;
-          return -1;
-        }
+int hashtable_insertref(hashtable *hashtbl, void *key, size_t key_size, void *data) {
+  return table_put(hashtbl,key,key_size,data,0,0,hashtbl->hashfunc(key,key_size),NULL,NULL);
+}
 
-        if(olddata_size!=0) {
-          free(olddata);
-        }
+void *hashtable_emplace(hashtable *hashtbl, void *key, size_t key_size, size_t data_size, int *inserted) {
+  struct hashnode *node;
+  int added;
 
-        memcpy(curr_node->data,data,data_size);
-        return 0;
-      }
+  if(hashtbl->sync || hashtbl->map || hashtbl->frozen) {
+    return NULL;
+  }
+
+  if(table_put(hashtbl,key,key_size,NULL,data_size,1,hashtbl->hashfunc(key,key_size),&node,&added)<0) {
+    return NULL;
+  }
+  /* References count as the wrong size, since their size isn't known. */
+  if(!added && (node->data_size!=data_size || (data_size==0 && node->data.ptr!=&empty_data))) {
+    if(node_resize_data(hashtbl,node,data_size)<0) {
+      return NULL;
     }
-    curr_node=curr_node->next;
   }
 
-  curr_node = (struct hashnode*)malloc(sizeof(struct hashnode));
-  if(!curr_node) {
-    return -1;
+  if(inserted) {
+    *inserted=added;
   }
+  return node_data(node);
+}
 
+void *hashtable_get_or_insert(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size) {
+  struct hashnode *node;
+  int added;
 
-  curr_node->key_size=key_size;
-  curr_node->key = malloc(key_size);
-  if(!curr_node->key) {
-    free(curr_node);
-    return -1;
+  if(hashtbl->sync || hashtbl->map || hashtbl->frozen) {
+    return NULL;
   }
-  memcpy(curr_node->key,key,key_size);
 
-  curr_node->data_size=data_size;
-  curr_node->data = malloc(data_size);
-  if(!curr_node->data) {
-    free(curr_node->key);
-    free(curr_node);
-    return -1;
+  if(table_put(hashtbl,key,key_size,data,data_size,1,hashtbl->hashfunc(key,key_size),&node,&added)<0) {
+    return NULL;
   }
-  memcpy(curr_node->data,data,data_size);
-  
-  curr_node->next = hashtbl->nodearray[hashpos];
-  hashtbl->nodearray[hashpos]=curr_node;
+  return node_data(node);
+}
 
-  return 0;
+int hashtable_remove(hashtable *hashtbl, void *key, size_t key_size) {
+  return hashtable_remove_prehashed(hashtbl,key,key_size,hashtbl->hashfunc(key,key_size));
 }
 
-int hashtable_insertref(hashtable *hashtbl, void *key, size_t key_size, void *data) {
+int hashtable_remove_prehashed(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash) {
   struct hashnode *curr_node;
   size_t hashpos;
+  struct hashnode *prev_node;
 
-  hashpos = hashtbl->hashfunc(key,key_size)%hashtbl->size;
+  if(hashtbl->sync) {
+    return sync_remove(hashtbl,key,key_size,hash);
+  }
 
-  curr_node = hashtbl->nodearray[hashpos];
-  while(curr_node) {
-    if(key_size==curr_node->key_size) {
-      if(memcmp(key,curr_node->key,key_size)==0) {
-        if(curr_node->data_size!=0) {
-          free(curr_node->data);
-        }
+  if(hashtbl->map || hashtbl->frozen) {
+    return -1;
+  }
+
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    if(hashtbl->old_ctrl) {
+      open_rehash(hashtbl,REHASH_SLOTS);
+    }
+
+    hashpos = open_find(hashtbl->ctrl,hashtbl->slots,hashtbl->size,hash,key,key_size);
+    if(hashpos!=NOT_FOUND) {
+      node_release(hashtbl,&hashtbl->slots[hashpos]);
+      open_set_ctrl(hashtbl->ctrl,hashtbl->size,hashpos,CTRL_DELETED);
+      hashtbl->deleted++;
+      hashtbl->count--;
+      return 0;
+    }
 
-        curr_node->data_size=0;
-        curr_node->data=data;
+    if(hashtbl->old_ctrl) {
+      hashpos = open_find(hashtbl->old_ctrl,hashtbl->old_slots,hashtbl->old_size,hash,key,key_size);
+      if(hashpos!=NOT_FOUND) {
+        node_release(hashtbl,&hashtbl->old_slots[hashpos]);
+        open_set_ctrl(hashtbl->old_ctrl,hashtbl->old_size,hashpos,CTRL_DELETED);
+        hashtbl->count--;
         return 0;
       }
     }
-    curr_node=curr_node->next;
-  }
-
-  curr_node = (struct hashnode*)malloc(sizeof(struct hashnode));
-  if(!curr_node) {
     return -1;
   }
 
-  curr_node->key_size=key_size;
-  curr_node->key = malloc(key_size);
-  if(!curr_node->key) {
-    free(curr_node);
-    return -1;
+  if(hashtbl->old_nodearray) {
+    chain_move_bucket(hashtbl,hash%hashtbl->old_size);
+    chain_rehash(hashtbl,REHASH_BUCKETS);
   }
-  memcpy(curr_node->key,key,key_size);
 
-  curr_node->data_size=0;
-  curr_node->data = data;
-  
-  curr_node->next = hashtbl->nodearray[hashpos];
-  hashtbl->nodearray[hashpos]=curr_node;
-
-  return 0;
-}
-
-int hashtable_remove(hashtable *hashtbl, void *key, size_t key_size) {
-  struct hashnode *curr_node;
-  size_t hashpos;
-  struct hashnode *prev_node;
-  
-  hashpos = hashtbl->hashfunc(key,key_size)%hashtbl->size;
+  hashpos = hash%hashtbl->size;
 
   curr_node = hashtbl->nodearray[hashpos];
   prev_node = NULL;
 
   while(curr_node) {
-    if(key_size==curr_node->key_size) {
-      if(memcmp(key,curr_node->key,key_size)==0) {
-        free(curr_node->key);
-        if(curr_node->data_size!=0) {
-          free(curr_node->data);
-        }
+    if(hash==curr_node->hash && key_size==curr_node->key_size) {
+      if(memcmp(key,node_key(curr_node),key_size)==0) {
+        node_release(hashtbl,curr_node);
         if(prev_node) {
           prev_node->next=curr_node->next;
         }
         else {
           hashtbl->nodearray[hashpos]=curr_node->next;
         }
-        free(curr_node);
+        entry_free(hashtbl,curr_node,sizeof(struct hashnode));
+        hashtbl->count--;
         return 0;
       }
     }
@@ -191,17 +641,62 @@ int hashtable_remove(hashtable *hashtbl, void *key, size_t key_size) {
 }
 
 void *hashtable_get(hashtable *hashtbl, void *key, size_t key_size) {
+  return hashtable_get_prehashed(hashtbl,key,key_size,hashtbl->hashfunc(key,key_size));
+}
+
+void *hashtable_get_prehashed(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash) {
   struct hashnode *curr_node;
   size_t hashpos;
-  
-  hashpos = hashtbl->hashfunc(key,key_size)%hashtbl->size;
+
+  if(hashtbl->sync) {
+    curr_node = sync_find(hashtbl,key,key_size,hash);
+    return curr_node ? node_data(curr_node) : NULL;
+  }
+
+  if(hashtbl->map) {
+    hashpos = map_find(hashtbl,hash,key,key_size);
+    if(hashpos!=NOT_FOUND) {
+      return map_data(map_entry(hashtbl,hashpos));
+    }
+    return NULL;
+  }
+
+  if(hashtbl->frozen) {
+    hashpos = frozen_find(hashtbl,hash,key,key_size);
+    if(hashpos!=NOT_FOUND) {
+      return node_data(&hashtbl->slots[hashpos]);
+    }
+    return NULL;
+  }
+
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    hashpos = open_find(hashtbl->ctrl,hashtbl->slots,hashtbl->size,hash,key,key_size);
+    if(hashpos!=NOT_FOUND) {
+      return node_data(&hashtbl->slots[hashpos]);
+    }
+
+    if(hashtbl->old_ctrl) {
+      hashpos = open_find(hashtbl->old_ctrl,hashtbl->old_slots,hashtbl->old_size,hash,key,key_size);
+      if(hashpos!=NOT_FOUND) {
+        return node_data(&hashtbl->old_slots[hashpos]);
+      }
+    }
+    return NULL;
+  }
+
+  if(hashtbl->old_nodearray) {
+    chain_move_bucket(hashtbl,hash%hashtbl->old_size);
+    chain_rehash(hashtbl,REHASH_BUCKETS);
+  }
+
+  hashpos = hash%hashtbl->size;
 
   curr_node = hashtbl->nodearray[hashpos];
 
   while(curr_node) {
-    if(key_size==curr_node->key_size) {
-      if(memcmp(key,curr_node->key,key_size)==0) {
-        return curr_node->data;
+    if(hash==curr_node->hash && key_size==curr_node->key_size) {
+      if(memcmp(key,node_key(curr_node),key_size)==0) {
+        return node_data(curr_node);
       }
     }
     curr_node=curr_node->next;
@@ -209,89 +704,2157 @@ void *hashtable_get(hashtable *hashtbl, void *key, size_t key_size) {
   return NULL;
 }
 
-void hashtable_free(hashtable *hashtbl) {
-  int i;
+/* A software pipeline: while key i is looked up, the first node of key
+ * i+GET_MANY_AHEAD is prefetched (chained tables) and the bucket of key
+ * i+2*GET_MANY_AHEAD is hashed and prefetched, so several cache misses are
+ * always in flight. Frozen tables prefetch the seed in the first step and
+ * the entry in the second. Concurrent tables skip the prefetching, as
+ * reading their arrays needs the atomic loads of the normal lookup. */
+size_t hashtable_get_many(hashtable *hashtbl, void *keys, size_t key_size, void **out, size_t n) {
+  uint8_t *key = (uint8_t *)keys;
+  uint64_t hashes[GET_MANY_RING];
   struct hashnode *curr_node;
-  struct hashnode *next_node;
+  struct hashfrozen *frozen = hashtbl->frozen;
+  size_t found = 0;
+  size_t mask = hashtbl->size-1;
+  size_t i, k, slot;
+  int open = hashtbl->flags&(HASHTABLE_OPEN|HASHTABLE_MAPPED);
+  int prefetch = !hashtbl->sync;
 
-  for(i=0;i<hashtbl->size;i++) {
-    curr_node = hashtbl->nodearray[i];
-    while(curr_node) {
-      next_node=curr_node->next;
-      free(curr_node->key);
-      if(curr_node->data_size!=0) {
-        free(curr_node->data);
+  for(i=0;i<n+2*GET_MANY_AHEAD;i++) {
+    if(i<n) {
+      hashes[i%GET_MANY_RING] = hashtbl->hashfunc(key+i*key_size,key_size);
+      if(prefetch) {
+        if(frozen) {
+          __builtin_prefetch(&frozen->seeds[frozen_range(hashes[i%GET_MANY_RING],frozen->buckets)]);
+        }
+        else if(open) {
+          k = (hashes[i%GET_MANY_RING]>>7)&mask;
+          __builtin_prefetch(hashtbl->ctrl+k);
+          if(hashtbl->map_slots) {
+            __builtin_prefetch(&hashtbl->map_slots[k]);
+          }
+          else {
+            __builtin_prefetch(&hashtbl->slots[k]);
+          }
+        }
+        else {
+          __builtin_prefetch(&hashtbl->nodearray[hashes[i%GET_MANY_RING]%hashtbl->size]);
+        }
+      }
+    }
+
+    k = i-GET_MANY_AHEAD;
+    if(prefetch && frozen && i>=GET_MANY_AHEAD && k<n) {
+      slot = frozen_slot(hashes[k%GET_MANY_RING],frozen->seeds[frozen_range(hashes[k%GET_MANY_RING],frozen->buckets)],frozen->slots);
+      if(slot<hashtbl->count) {
+        __builtin_prefetch(&hashtbl->slots[slot]);
+      }
+    }
+    else if(prefetch && !open && i>=GET_MANY_AHEAD && k<n) {
+      curr_node = hashtbl->nodearray[hashes[k%GET_MANY_RING]%hashtbl->size];
+      if(curr_node) {
+        __builtin_prefetch(curr_node);
+      }
+    }
+
+    k = i-2*GET_MANY_AHEAD;
+    if(i>=2*GET_MANY_AHEAD && k<n) {
+      out[k] = hashtable_get_prehashed(hashtbl,key+k*key_size,key_size,hashes[k%GET_MANY_RING]);
+      if(out[k]) {
+        found++;
       }
-      free(curr_node);
-      curr_node=next_node;
     }
   }
 
-  free(hashtbl->nodearray);
-  free(hashtbl);
+  return found;
 }
 
+int hashtable_get_copy(hashtable *hashtbl, void *key, size_t key_size, void *out, size_t out_size) {
+  void *data;
+  int token;
 
-hashtable_iterator *hashtable_iterator_create(hashtable *hashtable) {
-  hashtable_iterator *iterator;
-
-  iterator = (hashtable_iterator *)malloc(sizeof(hashtable_iterator));
-  if(!iterator) {
-    return NULL;
+  token = hashtable_read_begin(hashtbl);
+  data = hashtable_get(hashtbl,key,key_size);
+  if(data) {
+    memcpy(out,data,out_size);
   }
+  hashtable_read_end(hashtbl,token);
 
-  iterator->iterating_table = hashtable;
-  iterator->table_row = -1;
-  iterator->current_node = NULL;
-
-  return iterator;
+  return data ? 0 : -1;
 }
 
-void hashtable_iterator_next(hashtable_iterator *iterator) {
-  if(iterator->current_node!=NULL) {
-    iterator->current_node=iterator->current_node->next;
-  }
+int hashtable_read_begin(hashtable *hashtbl) {
+  struct hashsync *sync = hashtbl->sync;
+  int phase;
 
-  while(iterator->current_node==NULL) {
-    iterator->table_row++;
-    if(iterator->table_row>=iterator->iterating_table->size) break;
-    iterator->current_node = iterator->iterating_table->nodearray[iterator->table_row];
+  if(!sync) {
+    return 0;
   }
-}
 
-void *hashtable_iterator_get_key(hashtable_iterator *iterator) {
-  if(iterator->current_node==NULL) {
-    return NULL;
+  if(reader_slot<0) {
+    reader_slot = __atomic_fetch_add(&next_reader_slot,1,__ATOMIC_RELAXED)%SYNC_READER_SLOTS;
   }
+  phase = __atomic_load_n(&sync->epoch,__ATOMIC_RELAXED)&1;
+  __atomic_fetch_add(&sync->readers[reader_slot].count[phase],1,__ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  reader_depth++;
 
-  return iterator->current_node->key;
+  return reader_slot*2+phase;
 }
 
-size_t hashtable_iterator_get_key_size(hashtable_iterator *iterator) {
-  if(iterator->current_node==NULL) {
-    return 0;
+void hashtable_read_end(hashtable *hashtbl, int token) {
+  if(!hashtbl->sync) {
+    return;
   }
-  
-  return iterator->current_node->key_size;
+
+  reader_depth--;
+  __atomic_fetch_sub(&hashtbl->sync->readers[token>>1].count[token&1],1,__ATOMIC_RELEASE);
 }
 
-void *hashtable_iterator_get_data(hashtable_iterator *iterator) {
-  if(iterator->current_node==NULL) {
-    return NULL;
-  }
+void hashtable_stats(hashtable *hashtbl, struct hashtable_stats *stats) {
+  struct hashnode *curr_node;
+  uint64_t hash;
+  size_t length;
+  size_t mask;
+  size_t pos, step;
+  size_t i;
 
-  return iterator->current_node->data;
-}
+  rehash_finish(hashtbl);
 
-size_t hashtable_iterator_get_data_size(hashtable_iterator *iterator) {
-  if(iterator->current_node==NULL) {
-    return 0;
+  memset(stats,0,sizeof(struct hashtable_stats));
+  stats->count=hashtbl->count;
+  stats->buckets=hashtbl->size;
+  stats->load=(double)hashtbl->count/hashtbl->size;
+  stats->deleted=hashtbl->deleted;
+  stats->bytes=sizeof(hashtable);
+
+  if(hashtbl->frozen) {
+    /* Every entry is found at the first place looked. */
+    stats->buckets=hashtbl->frozen->slots;
+    stats->load=(double)hashtbl->count/hashtbl->frozen->slots;
+    stats->bytes+=sizeof(struct hashfrozen)+hashtbl->frozen->buckets*sizeof(uint16_t);
+    stats->bytes+=(hashtbl->frozen->slots-hashtbl->count)*sizeof(size_t);
+    stats->bytes+=hashtbl->count*sizeof(struct hashnode);
+    for(i=0;i<hashtbl->count;i++) {
+      stats->bytes+=node_bytes(&hashtbl->slots[i]);
+    }
+    stats->lengths[0]=hashtbl->count;
+    return;
   }
 
-  return iterator->current_node->data_size;
-}
+  if(hashtbl->map) {
+    stats->bytes+=hashtbl->map_size;
+  }
+  else if(hashtbl->flags&HASHTABLE_OPEN) {
+    stats->bytes+=hashtbl->size+GROUP_WIDTH+hashtbl->size*sizeof(struct hashnode);
+  }
+
+  if(hashtbl->flags&(HASHTABLE_OPEN|HASHTABLE_MAPPED)) {
+    mask=hashtbl->size-1;
+    for(i=0;i<hashtbl->size;i++) {
+      if(hashtbl->ctrl[i]&0x80) {
+        continue;
+      }
+      if(hashtbl->map) {
+        hash=hashtbl->map_slots[i].hash;
+      }
+      else {
+        curr_node=&hashtbl->slots[i];
+        hash=curr_node->hash;
+        if(!hashtbl->pool) {
+          stats->bytes+=node_bytes(curr_node);
+        }
+      }
+      pos=(size_t)(hash>>7)&mask;
+      for(length=0,step=0;((i-pos)&mask)>=GROUP_WIDTH;length++) {
+        step+=GROUP_WIDTH;
+        pos=(pos+step)&mask;
+      }
+      stats->lengths[length<HASHTABLE_STATS_LENGTHS ? length : HASHTABLE_STATS_LENGTHS-1]++;
+      if(length>stats->max_length) {
+        stats->max_length=length;
+      }
+    }
+  }
+  else {
+    stats->bytes+=hashtbl->size*sizeof(struct hashnode *);
+    for(i=0;i<hashtbl->size;i++) {
+      length=0;
+      for(curr_node=hashtbl->nodearray[i];curr_node;curr_node=curr_node->next) {
+        length++;
+        if(!hashtbl->pool) {
+          stats->bytes+=sizeof(struct hashnode)+node_bytes(curr_node);
+        }
+      }
+      stats->lengths[length<HASHTABLE_STATS_LENGTHS ? length : HASHTABLE_STATS_LENGTHS-1]++;
+      if(length>stats->max_length) {
+        stats->max_length=length;
+      }
+    }
+  }
+
+  if(hashtbl->pool) {
+    stats->bytes+=sizeof(struct hashpool)+hashtbl->pool->bytes;
+  }
+
+  if(hashtbl->sync) {
+    pthread_mutex_lock(&hashtbl->sync->retire_lock);
+    stats->bytes+=sizeof(struct hashsync)+hashtbl->sync->retired_size*sizeof(struct hashnode *);
+    for(i=0;i<hashtbl->sync->nretired;i++) {
+      stats->bytes+=sizeof(struct hashnode)+node_bytes(hashtbl->sync->retired[i]);
+    }
+    pthread_mutex_unlock(&hashtbl->sync->retire_lock);
+  }
+}
+
+int hashtable_set_max_load(hashtable *hashtbl, double max_load) {
+  if(hashtbl->map || hashtbl->frozen || !(max_load>0)) {
+    return -1;
+  }
+  if((hashtbl->flags&HASHTABLE_OPEN) && max_load>OPEN_LOAD) {
+    return -1;
+  }
+
+  hashtbl->max_load=max_load;
+  table_set_size(hashtbl,hashtbl->size);
+  return 0;
+}
+
+int hashtable_reserve(hashtable *hashtbl, size_t count) {
+  size_t size;
+
+  if(hashtbl->map || hashtbl->frozen) {
+    return -1;
+  }
+
+  if(hashtbl->sync) {
+    size = (size_t)(count/hashtbl->max_load)+1;
+    return sync_grow(hashtbl,(size+SYNC_STRIPES-1)/SYNC_STRIPES*SYNC_STRIPES);
+  }
+
+  rehash_finish(hashtbl);
+
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    size = open_capacity(hashtbl,count);
+    if(size<=hashtbl->size) {
+      return 0;
+    }
+    if(open_start_resize(hashtbl,size)<0) {
+      return -1;
+    }
+  }
+  else {
+    size = (size_t)(count/hashtbl->max_load)+1;
+    if(size<=hashtbl->size) {
+      return 0;
+    }
+    if(chain_start_resize(hashtbl,size)<0) {
+      return -1;
+    }
+  }
+
+  rehash_finish(hashtbl);
+  return 0;
+}
+
+/* Drops a resize in progress along with everything else rather than
+ * finishing it, and keeps the current arrays. */
+int hashtable_clear(hashtable *hashtbl) {
+  if(hashtbl->map || hashtbl->frozen) {
+    return -1;
+  }
+
+  if(hashtbl->sync) {
+    sync_clear(hashtbl);
+    return 0;
+  }
+
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    if(hashtbl->old_ctrl) {
+      open_free_nodes(hashtbl,hashtbl->old_ctrl,hashtbl->old_slots,hashtbl->old_size);
+      free(hashtbl->old_ctrl);
+      free(hashtbl->old_slots);
+      hashtbl->old_ctrl=NULL;
+      hashtbl->old_slots=NULL;
+    }
+    open_free_nodes(hashtbl,hashtbl->ctrl,hashtbl->slots,hashtbl->size);
+    memset(hashtbl->ctrl,CTRL_EMPTY,hashtbl->size+GROUP_WIDTH);
+    hashtbl->deleted=0;
+  }
+  else {
+    if(hashtbl->old_nodearray) {
+      chain_free_nodes(hashtbl,hashtbl->old_nodearray,hashtbl->old_size);
+      free(hashtbl->old_nodearray);
+      hashtbl->old_nodearray=NULL;
+    }
+    chain_free_nodes(hashtbl,hashtbl->nodearray,hashtbl->size);
+    memset(hashtbl->nodearray,0,hashtbl->size*sizeof(struct hashnode *));
+  }
+
+  hashtbl->old_size=0;
+  hashtbl->rehash_pos=0;
+  hashtbl->count=0;
+  return 0;
+}
+
+void hashtable_free(hashtable *hashtbl) {
+  size_t i;
+
+  if(hashtbl->map) {
+    munmap(hashtbl->map,hashtbl->map_size);
+    free(hashtbl);
+    return;
+  }
+
+  if(hashtbl->frozen) {
+    for(i=0;i<hashtbl->count;i++) {
+      node_release(hashtbl,&hashtbl->slots[i]);
+    }
+    free(hashtbl->slots);
+    free(hashtbl->frozen->seeds);
+    free(hashtbl->frozen->remap);
+    free(hashtbl->frozen);
+    free(hashtbl);
+    return;
+  }
+
+  if(hashtbl->sync) {
+    sync_free(hashtbl);
+  }
+
+  /* Pooled entries all go at once with the pool. */
+  if(hashtbl->pool) {
+    pool_free(hashtbl->pool);
+  }
+
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    if(hashtbl->old_ctrl) {
+      if(!hashtbl->pool) {
+        open_free_nodes(hashtbl,hashtbl->old_ctrl,hashtbl->old_slots,hashtbl->old_size);
+      }
+      free(hashtbl->old_ctrl);
+      free(hashtbl->old_slots);
+    }
+    if(!hashtbl->pool) {
+      open_free_nodes(hashtbl,hashtbl->ctrl,hashtbl->slots,hashtbl->size);
+    }
+    free(hashtbl->ctrl);
+    free(hashtbl->slots);
+    free(hashtbl);
+    return;
+  }
+
+  if(hashtbl->old_nodearray) {
+    if(!hashtbl->pool) {
+      chain_free_nodes(hashtbl,hashtbl->old_nodearray,hashtbl->old_size);
+    }
+    free(hashtbl->old_nodearray);
+  }
+  if(!hashtbl->pool) {
+    chain_free_nodes(hashtbl,hashtbl->nodearray,hashtbl->size);
+  }
+  free(hashtbl->nodearray);
+  free(hashtbl);
+}
+
+
+/* Lays the entries out as in an open table at the default load, then
+ * writes the keys and data after the slots in the order they were placed,
+ * which takes two passes over the table. */
+int hashtable_snapshot(hashtable *hashtbl, const char *path) {
+  struct snapshot_header header;
+  struct snapshot_slot *slots;
+  struct snapshot_entry entry;
+  uint8_t *ctrl;
+  hashtable_iterator *iterator;
+  FILE *file;
+  char *tmp_path;
+  size_t tmp_size;
+  size_t capacity;
+  size_t slot;
+  size_t key_size, data_size;
+  uint64_t offset;
+  uint64_t hash;
+  int fd;
+  int ret = 0;
+
+  for(capacity=MIN_CAPACITY;hashtbl->count>(size_t)(capacity*OPEN_LOAD);capacity*=2);
+
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,SNAPSHOT_MAGIC,sizeof(header.magic));
+  header.version=SNAPSHOT_VERSION;
+  header.slot_size=sizeof(struct snapshot_slot);
+  header.byte_order=SNAPSHOT_BYTE_ORDER;
+  header.count=hashtbl->count;
+  header.capacity=capacity;
+  header.hash_check=hashtbl->hashfunc(SNAPSHOT_CHECK,sizeof(SNAPSHOT_CHECK)-1);
+  header.ctrl_offset=sizeof(header);
+  header.slots_offset=snapshot_align(header.ctrl_offset+capacity+GROUP_WIDTH);
+  header.blob_offset=header.slots_offset+capacity*sizeof(struct snapshot_slot);
+
+  ctrl = (uint8_t *)malloc(capacity+GROUP_WIDTH);
+  slots = (struct snapshot_slot *)calloc(capacity,sizeof(struct snapshot_slot));
+  iterator = hashtable_iterator_create(hashtbl);
+  if(!ctrl || !slots || !iterator) {
+    free(ctrl);
+    free(slots);
+    free(iterator);
+    return -1;
+  }
+  memset(ctrl,CTRL_EMPTY,capacity+GROUP_WIDTH);
+
+  offset=header.blob_offset;
+  for(hashtable_iterator_next(iterator);hashtable_iterator_get_key(iterator)!=NULL;hashtable_iterator_next(iterator)) {
+    if(hashtbl->map) {
+      hash=hashtbl->map_slots[iterator->table_row].hash;
+    }
+    else {
+      /* References can't be written out. */
+      if(iterator->current_node->data_size==0 && iterator->current_node->data.ptr!=&empty_data) {
+        ret=-1;
+        break;
+      }
+      hash=iterator->current_node->hash;
+    }
+    key_size=hashtable_iterator_get_key_size(iterator);
+    data_size=hashtable_iterator_get_data_size(iterator);
+
+    slot=open_find_free(ctrl,capacity,hash);
+    open_set_ctrl(ctrl,capacity,slot,hash&0x7f);
+    slots[slot].hash=hash;
+    slots[slot].entry_offset=offset;
+    offset+=sizeof(struct snapshot_entry)+snapshot_align(key_size)+snapshot_align(data_size);
+  }
+  header.file_size=offset;
+
+  /* Written beside path and renamed over it, so a process that has the
+   * old file mapped keeps its copy rather than seeing it truncated. */
+  tmp_size = strlen(path)+32;
+  tmp_path = (char *)malloc(tmp_size);
+  file = NULL;
+  if(ret==0 && tmp_path) {
+    snprintf(tmp_path,tmp_size,"%s.%ld.%u.tmp",path,(long)getpid(),__atomic_fetch_add(&snapshot_serial,1,__ATOMIC_RELAXED));
+    fd = open(tmp_path,O_WRONLY|O_CREAT|O_EXCL,0666);
+    if(fd>=0) {
+      file = fdopen(fd,"wb");
+      if(!file) {
+        close(fd);
+        unlink(tmp_path);
+      }
+    }
+  }
+  if(!file) {
+    free(ctrl);
+    free(slots);
+    free(tmp_path);
+    hashtable_iterator_free(iterator);
+    return -1;
+  }
+
+  fwrite(&header,sizeof(header),1,file);
+  fwrite(ctrl,capacity+GROUP_WIDTH,1,file);
+  snapshot_pad(file,header.ctrl_offset+capacity+GROUP_WIDTH);
+  fwrite(slots,sizeof(struct snapshot_slot),capacity,file);
+
+  iterator->table_row=-1;
+  iterator->current_node=NULL;
+  for(hashtable_iterator_next(iterator);hashtable_iterator_get_key(iterator)!=NULL;hashtable_iterator_next(iterator)) {
+    entry.key_size=key_size=hashtable_iterator_get_key_size(iterator);
+    entry.data_size=data_size=hashtable_iterator_get_data_size(iterator);
+    fwrite(&entry,sizeof(entry),1,file);
+    fwrite(hashtable_iterator_get_key(iterator),1,key_size,file);
+    snapshot_pad(file,key_size);
+    fwrite(hashtable_iterator_get_data(iterator),1,data_size,file);
+    snapshot_pad(file,data_size);
+  }
+
+  if(ferror(file)) {
+    ret=-1;
+  }
+  if(fclose(file)!=0) {
+    ret=-1;
+  }
+  if(ret==0) {
+    ret=snapshot_sum(tmp_path);
+  }
+  if(ret==0 && rename(tmp_path,path)<0) {
+    ret=-1;
+  }
+  if(ret<0) {
+    unlink(tmp_path);
+  }
+
+  free(ctrl);
+  free(slots);
+  free(tmp_path);
+  hashtable_iterator_free(iterator);
+  return ret;
+}
+
+hashtable *hashtable_map(const char *path, uint64_t (*hashfunc)(void *, size_t), int validate) {
+  struct snapshot_header *header;
+  struct stat st;
+  hashtable *hashtbl;
+  uint8_t *map;
+  int fd;
+
+  if(!hashfunc) {
+    hashfunc=fnv1a64;
+  }
+
+  fd = open(path,O_RDONLY);
+  if(fd<0) {
+    return NULL;
+  }
+  if(fstat(fd,&st)<0 || (size_t)st.st_size<sizeof(struct snapshot_header)) {
+    close(fd);
+    return NULL;
+  }
+  map = (uint8_t *)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(map==MAP_FAILED) {
+    return NULL;
+  }
+
+  header = (struct snapshot_header *)map;
+  if(snapshot_check(header,st.st_size,hashfunc)<0) {
+    munmap(map,st.st_size);
+    return NULL;
+  }
+
+  hashtbl = (hashtable *)calloc(1,sizeof(hashtable));
+  if(!hashtbl) {
+    munmap(map,st.st_size);
+    return NULL;
+  }
+
+  hashtbl->flags=HASHTABLE_MAPPED;
+  hashtbl->hashfunc=hashfunc;
+  hashtbl->count=header->count;
+  hashtbl->size=header->capacity;
+  hashtbl->max_load=OPEN_LOAD;
+  hashtbl->grow_at=hashtbl->count;
+  hashtbl->map=map;
+  hashtbl->map_size=st.st_size;
+  hashtbl->ctrl=map+header->ctrl_offset;
+  hashtbl->map_slots=(struct snapshot_slot *)(map+header->slots_offset);
+
+  if(validate && map_validate(hashtbl)<0) {
+    hashtable_free(hashtbl);
+    return NULL;
+  }
+
+  return hashtbl;
+}
+
+/* Copies the entries into an array, places them with frozen_build and then
+ * moves each one to its slot, or where remap says. Until then the copies sit in the
+ * new table's slots with count covering them, so hashtable_free can clean
+ * up after a failure. */
+hashtable *hashtable_freeze(hashtable *hashtbl) {
+  hashtable *frozen_tbl;
+  hashtable_iterator iterator;
+  struct hashnode *node;
+  struct hashnode *nodes;
+  uint64_t *hashes;
+  size_t *slot_of;
+  size_t n = hashtbl->count;
+  size_t i;
+  uint64_t hash;
+  int copy;
+  int ret;
+
+  frozen_tbl = (hashtable *)calloc(1,sizeof(hashtable));
+  if(!frozen_tbl) {
+    return NULL;
+  }
+  frozen_tbl->flags=HASHTABLE_FROZEN;
+  frozen_tbl->hashfunc=hashtbl->hashfunc;
+  frozen_tbl->max_load=1.0;
+  frozen_tbl->frozen=(struct hashfrozen *)calloc(1,sizeof(struct hashfrozen));
+  frozen_tbl->slots=(struct hashnode *)malloc((n+1)*sizeof(struct hashnode));
+  if(!frozen_tbl->frozen || !frozen_tbl->slots) {
+    free(frozen_tbl->frozen);
+    free(frozen_tbl->slots);
+    free(frozen_tbl);
+    return NULL;
+  }
+
+  hashes = (uint64_t *)malloc((n+1)*sizeof(uint64_t));
+  slot_of = (size_t *)malloc((n+1)*sizeof(size_t));
+  ret = hashes && slot_of ? 0 : -1;
+
+  hashtable_iterator_init(hashtbl,&iterator);
+  for(hashtable_iterator_next(&iterator);ret==0 && hashtable_iterator_get_key(&iterator)!=NULL;hashtable_iterator_next(&iterator)) {
+    if(hashtbl->map) {
+      hash=hashtbl->map_slots[iterator.table_row].hash;
+      copy=1;
+    }
+    else {
+      hash=iterator.current_node->hash;
+      copy=iterator.current_node->data_size!=0 || iterator.current_node->data.ptr==&empty_data;
+    }
+
+    node=&frozen_tbl->slots[frozen_tbl->count];
+    if(node_set_key(frozen_tbl,node,hashtable_iterator_get_key(&iterator),hashtable_iterator_get_key_size(&iterator),hash)<0) {
+      ret=-1;
+      break;
+    }
+    if(node_set_data(frozen_tbl,node,hashtable_iterator_get_data(&iterator),hashtable_iterator_get_data_size(&iterator),copy)<0) {
+      node_release(frozen_tbl,node);
+      ret=-1;
+      break;
+    }
+    hashes[frozen_tbl->count++]=hash;
+  }
+
+  if(ret==0) {
+    ret=frozen_build(frozen_tbl->frozen,hashes,n,slot_of);
+  }
+  nodes = ret==0 ? (struct hashnode *)malloc((n+1)*sizeof(struct hashnode)) : NULL;
+  if(!nodes) {
+    free(hashes);
+    free(slot_of);
+    hashtable_free(frozen_tbl);
+    return NULL;
+  }
+
+  for(i=0;i<n;i++) {
+    if(slot_of[i]<n) {
+      nodes[slot_of[i]]=frozen_tbl->slots[i];
+    }
+    else {
+      nodes[frozen_tbl->frozen->remap[slot_of[i]-n]]=frozen_tbl->slots[i];
+    }
+  }
+  free(frozen_tbl->slots);
+  frozen_tbl->slots=nodes;
+  frozen_tbl->size=n;
+  frozen_tbl->grow_at=n;
+
+  free(hashes);
+  free(slot_of);
+  return frozen_tbl;
+}
+
+void hashtable_iterator_init(hashtable *hashtable, hashtable_iterator *iterator) {
+  rehash_finish(hashtable);
+
+  iterator->iterating_table = hashtable;
+  iterator->table_row = -1;
+  iterator->current_node = NULL;
+}
+
+hashtable_iterator *hashtable_iterator_create(hashtable *hashtable) {
+  hashtable_iterator *iterator;
+
+  iterator = (hashtable_iterator *)malloc(sizeof(hashtable_iterator));
+  if(!iterator) {
+    return NULL;
+  }
+
+  hashtable_iterator_init(hashtable,iterator);
+  return iterator;
+}
+
+void hashtable_iterator_next(hashtable_iterator *iterator) {
+  hashtable *hashtbl = iterator->iterating_table;
+
+  /* Mapped tables have no nodes, the accessors read the slot at table_row
+   * instead. */
+  if(hashtbl->map) {
+    for(iterator->table_row++;iterator->table_row<hashtbl->size;iterator->table_row++) {
+      if(!(hashtbl->ctrl[iterator->table_row]&0x80)) {
+        break;
+      }
+    }
+    return;
+  }
+
+  if(hashtbl->frozen) {
+    iterator->table_row++;
+    if(iterator->table_row<hashtbl->count) {
+      iterator->current_node=&hashtbl->slots[iterator->table_row];
+    }
+    else {
+      iterator->current_node=NULL;
+    }
+    return;
+  }
+
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    iterator->current_node=NULL;
+    for(iterator->table_row++;iterator->table_row<hashtbl->size;iterator->table_row++) {
+      if(!(hashtbl->ctrl[iterator->table_row]&0x80)) {
+        iterator->current_node=&hashtbl->slots[iterator->table_row];
+        break;
+      }
+    }
+    return;
+  }
+
+  if(iterator->current_node!=NULL) {
+    iterator->current_node=iterator->current_node->next;
+  }
+
+  while(iterator->current_node==NULL) {
+    iterator->table_row++;
+    if(iterator->table_row>=hashtbl->size) break;
+    iterator->current_node = hashtbl->nodearray[iterator->table_row];
+  }
+}
+
+void *hashtable_iterator_get_key(hashtable_iterator *iterator) {
+  struct snapshot_entry *entry;
+
+  if(iterator->iterating_table->map) {
+    entry = map_iterator_entry(iterator);
+    return entry ? map_key(entry) : NULL;
+  }
+
+  if(iterator->current_node==NULL) {
+    return NULL;
+  }
+
+  return node_key(iterator->current_node);
+}
+
+size_t hashtable_iterator_get_key_size(hashtable_iterator *iterator) {
+  struct snapshot_entry *entry;
+
+  if(iterator->iterating_table->map) {
+    entry = map_iterator_entry(iterator);
+    return entry ? entry->key_size : 0;
+  }
+
+  if(iterator->current_node==NULL) {
+    return 0;
+  }
+
+  return iterator->current_node->key_size;
+}
+
+void *hashtable_iterator_get_data(hashtable_iterator *iterator) {
+  struct snapshot_entry *entry;
+
+  if(iterator->iterating_table->map) {
+    entry = map_iterator_entry(iterator);
+    return entry ? map_data(entry) : NULL;
+  }
+
+  if(iterator->current_node==NULL) {
+    return NULL;
+  }
+
+  return node_data(iterator->current_node);
+}
+
+size_t hashtable_iterator_get_data_size(hashtable_iterator *iterator) {
+  struct snapshot_entry *entry;
+
+  if(iterator->iterating_table->map) {
+    entry = map_iterator_entry(iterator);
+    return entry ? entry->data_size : 0;
+  }
+
+  if(iterator->current_node==NULL) {
+    return 0;
+  }
+
+  return iterator->current_node->data_size;
+}
 
 void hashtable_iterator_free(hashtable_iterator *iterator) {
   free(iterator);
 }
 
+/* Open and mapped tables are scanned a group of control bytes at a time,
+ * so runs of empty slots cost one compare per 16 slots. */
+int hashtable_foreach(hashtable *hashtbl, int (*visit)(void *key, size_t key_size, void *data, size_t data_size, void *ctx), void *ctx) {
+  struct hashnode *curr_node;
+  struct snapshot_entry *entry;
+  group_mask full;
+  size_t pos, slot;
+  int ret;
+
+  rehash_finish(hashtbl);
+
+  if(hashtbl->frozen) {
+    for(pos=0;pos<hashtbl->count;pos++) {
+      curr_node = &hashtbl->slots[pos];
+      ret = visit(node_key(curr_node),curr_node->key_size,node_data(curr_node),curr_node->data_size,ctx);
+      if(ret) {
+        return ret;
+      }
+    }
+    return 0;
+  }
+
+  if(hashtbl->flags&(HASHTABLE_OPEN|HASHTABLE_MAPPED)) {
+    for(pos=0;pos<hashtbl->size;pos+=GROUP_WIDTH) {
+      for(full=group_match_full(hashtbl->ctrl+pos);full;full&=full-1) {
+        slot = pos+group_first(full);
+        if(hashtbl->map) {
+          entry = map_entry(hashtbl,slot);
+          ret = visit(map_key(entry),entry->key_size,map_data(entry),entry->data_size,ctx);
+        }
+        else {
+          curr_node = &hashtbl->slots[slot];
+          ret = visit(node_key(curr_node),curr_node->key_size,node_data(curr_node),curr_node->data_size,ctx);
+        }
+        if(ret) {
+          return ret;
+        }
+      }
+    }
+    return 0;
+  }
+
+  for(pos=0;pos<hashtbl->size;pos++) {
+    for(curr_node=hashtbl->nodearray[pos];curr_node;curr_node=curr_node->next) {
+      ret = visit(node_key(curr_node),curr_node->key_size,node_data(curr_node),curr_node->data_size,ctx);
+      if(ret) {
+        return ret;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Keys and copied data small enough to fit are kept inside the node. Data
+ * with a data_size of 0 is a reference and always sits in data.ptr. */
+static inline void *node_key(struct hashnode *node) {
+  if(node->key_size<=HASHNODE_INLINE_KEY) {
+    return node->key.bytes;
+  }
+  return node->key.ptr;
+}
+
+static inline void *node_data(struct hashnode *node) {
+  if(node->data_size!=0 && node->data_size<=HASHNODE_INLINE_DATA) {
+    return node->data.bytes;
+  }
+  return node->data.ptr;
+}
+
+static void *entry_alloc(hashtable *hashtbl, size_t size) {
+  struct hashpool *pool = hashtbl->pool;
+  struct pool_block *block;
+  struct pool_chunk *chunk;
+  size_t class;
+
+  if(!pool) {
+    __atomic_fetch_add(&hashtbl->allocations,1,__ATOMIC_RELAXED);
+    return malloc(size);
+  }
+
+  if(size>POOL_MAX) {
+    chunk = (struct pool_chunk *)malloc(sizeof(struct pool_chunk)+size);
+    if(!chunk) {
+      return NULL;
+    }
+    hashtbl->allocations++;
+    pool->bytes+=sizeof(struct pool_chunk)+size;
+    if(!pool->large.next) {
+      pool->large.next=&pool->large;
+      pool->large.prev=&pool->large;
+    }
+    chunk->next=pool->large.next;
+    chunk->prev=&pool->large;
+    chunk->next->prev=chunk;
+    pool->large.next=chunk;
+    return chunk+1;
+  }
+
+  class = size ? (size-1)/POOL_GRAIN : 0;
+  block = pool->free[class];
+  if(block) {
+    pool->free[class]=block->next;
+    return block;
+  }
+
+  size = (class+1)*POOL_GRAIN;
+  if(pool->slab_left<size) {
+    chunk = (struct pool_chunk *)malloc(POOL_SLAB);
+    if(!chunk) {
+      return NULL;
+    }
+    hashtbl->allocations++;
+    pool->bytes+=POOL_SLAB;
+    chunk->next=pool->slabs;
+    pool->slabs=chunk;
+    pool->slab_pos=(uint8_t *)(chunk+1);
+    pool->slab_left=POOL_SLAB-sizeof(struct pool_chunk);
+  }
+
+  block = (struct pool_block *)pool->slab_pos;
+  pool->slab_pos+=size;
+  pool->slab_left-=size;
+  return block;
+}
+
+static void entry_free(hashtable *hashtbl, void *ptr, size_t size) {
+  struct hashpool *pool = hashtbl->pool;
+  struct pool_block *block = (struct pool_block *)ptr;
+  struct pool_chunk *chunk;
+  size_t class;
+
+  if(!pool) {
+    free(ptr);
+    return;
+  }
+
+  if(size>POOL_MAX) {
+    chunk = (struct pool_chunk *)ptr-1;
+    pool->bytes-=sizeof(struct pool_chunk)+size;
+    chunk->prev->next=chunk->next;
+    chunk->next->prev=chunk->prev;
+    free(chunk);
+    return;
+  }
+
+  class = size ? (size-1)/POOL_GRAIN : 0;
+  block->next=pool->free[class];
+  pool->free[class]=block;
+}
+
+static void pool_free(struct hashpool *pool) {
+  struct pool_chunk *chunk;
+  struct pool_chunk *next;
+
+  for(chunk=pool->slabs;chunk;chunk=next) {
+    next=chunk->next;
+    free(chunk);
+  }
+
+  if(pool->large.next) {
+    for(chunk=pool->large.next;chunk!=&pool->large;chunk=next) {
+      next=chunk->next;
+      free(chunk);
+    }
+  }
+
+  free(pool);
+}
+
+static int node_set_key(hashtable *hashtbl, struct hashnode *node, void *key, size_t key_size, uint64_t hash) {
+  node->hash=hash;
+  node->key_size=key_size;
+  if(key_size<=HASHNODE_INLINE_KEY) {
+    memcpy(node->key.bytes,key,key_size);
+  }
+  else {
+    node->key.ptr = entry_alloc(hashtbl,key_size);
+    if(!node->key.ptr) {
+      return -1;
+    }
+    memcpy(node->key.ptr,key,key_size);
+  }
+  node->data.ptr=NULL;
+  node->data_size=0;
+  node->next=NULL;
+
+  return 0;
+}
+
+/* Points the node at new data, copied or referenced. Old data on the heap
+ * is only freed once the new data is in place, as the new data may have
+ * come from it. */
+static int node_set_data(hashtable *hashtbl, struct hashnode *node, void *data, size_t data_size, int copy) {
+  void *olddata = node->data.ptr;
+  size_t olddata_size = node->data_size;
+  void *newdata;
+
+  if(!copy) {
+    node->data.ptr = data;
+    node->data_size = 0;
+  }
+  else if(data_size==0) {
+    node->data.ptr = &empty_data;
+    node->data_size = 0;
+  }
+  else if(data_size<=HASHNODE_INLINE_DATA) {
+    if(data) {
+      memmove(node->data.bytes,data,data_size);
+    }
+    else {
+      memset(node->data.bytes,0,data_size);
+    }
+    node->data_size = data_size;
+  }
+  else if(data_size==olddata_size) {
+    /* The old block fits, so overwrite it rather than swapping blocks. */
+    if(data) {
+      memmove(olddata,data,data_size);
+    }
+    else {
+      memset(olddata,0,data_size);
+    }
+    return 0;
+  }
+  else {
+    newdata = entry_alloc(hashtbl,data_size);
+    if(!newdata) {
+      return -1;
+    }
+    if(data) {
+      memcpy(newdata,data,data_size);
+    }
+    else {
+      memset(newdata,0,data_size);
+    }
+    node->data.ptr = newdata;
+    node->data_size = data_size;
+  }
+
+  if(olddata_size>HASHNODE_INLINE_DATA) {
+    entry_free(hashtbl,olddata,olddata_size);
+  }
+  return 0;
+}
+
+/* Gives the node data_size bytes of copied data, keeping as much of the
+ * old data as fits and zeroing the rest. */
+static int node_resize_data(hashtable *hashtbl, struct hashnode *node, size_t data_size) {
+  struct hashnode resized;
+  size_t keep = node->data_size<data_size ? node->data_size : data_size;
+
+  resized.data.ptr=NULL;
+  resized.data_size=0;
+  if(node_set_data(hashtbl,&resized,NULL,data_size,1)<0) {
+    return -1;
+  }
+  memcpy(node_data(&resized),node_data(node),keep);
+
+  if(node->data_size>HASHNODE_INLINE_DATA) {
+    entry_free(hashtbl,node->data.ptr,node->data_size);
+  }
+  node->data=resized.data;
+  node->data_size=resized.data_size;
+  return 0;
+}
+
+/* Heap memory behind a node, not counting the node itself. */
+static size_t node_bytes(struct hashnode *node) {
+  size_t bytes = 0;
+
+  if(node->key_size>HASHNODE_INLINE_KEY) {
+    bytes+=node->key_size;
+  }
+  if(node->data_size>HASHNODE_INLINE_DATA) {
+    bytes+=node->data_size;
+  }
+  return bytes;
+}
+
+static void node_release(hashtable *hashtbl, struct hashnode *node) {
+  if(node->key_size>HASHNODE_INLINE_KEY) {
+    entry_free(hashtbl,node->key.ptr,node->key_size);
+  }
+  if(node->data_size>HASHNODE_INLINE_DATA) {
+    entry_free(hashtbl,node->data.ptr,node->data_size);
+  }
+}
+
+/* Inserts or overwrites the entry for key, and points out at it if out
+ * isn't NULL. If inserted isn't NULL an existing entry is left as it is
+ * instead, and inserted says whether a new one was added. */
+static int table_put(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size, int copy, uint64_t hash, struct hashnode **out, int *inserted) {
+  struct hashnode *curr_node;
+  struct hashnode new_node;
+  size_t hashpos;
+
+  if(hashtbl->sync) {
+    return sync_put(hashtbl,key,key_size,data,data_size,copy,hash);
+  }
+
+  if(hashtbl->map || hashtbl->frozen) {
+    return -1;
+  }
+
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    if(hashtbl->old_ctrl) {
+      open_rehash(hashtbl,REHASH_SLOTS);
+    }
+
+    hashpos = open_find(hashtbl->ctrl,hashtbl->slots,hashtbl->size,hash,key,key_size);
+    if(hashpos!=NOT_FOUND) {
+      return table_found(hashtbl,&hashtbl->slots[hashpos],data,data_size,copy,out,inserted);
+    }
+
+    if(hashtbl->old_ctrl) {
+      hashpos = open_find(hashtbl->old_ctrl,hashtbl->old_slots,hashtbl->old_size,hash,key,key_size);
+      if(hashpos!=NOT_FOUND) {
+        return table_found(hashtbl,&hashtbl->old_slots[hashpos],data,data_size,copy,out,inserted);
+      }
+    }
+
+    if(node_set_key(hashtbl,&new_node,key,key_size,hash)<0) {
+      return -1;
+    }
+    if(node_set_data(hashtbl,&new_node,data,data_size,copy)<0 || open_make_room(hashtbl)<0) {
+      node_release(hashtbl,&new_node);
+      return -1;
+    }
+
+    hashpos = open_find_free(hashtbl->ctrl,hashtbl->size,hash);
+    if(hashtbl->ctrl[hashpos]==CTRL_DELETED) {
+      hashtbl->deleted--;
+    }
+    hashtbl->slots[hashpos]=new_node;
+    open_set_ctrl(hashtbl->ctrl,hashtbl->size,hashpos,hash&0x7f);
+    hashtbl->count++;
+    if(out) {
+      *out=&hashtbl->slots[hashpos];
+    }
+    if(inserted) {
+      *inserted=1;
+    }
+    return 0;
+  }
+
+  if(hashtbl->old_nodearray) {
+    chain_move_bucket(hashtbl,hash%hashtbl->old_size);
+    chain_rehash(hashtbl,REHASH_BUCKETS);
+  }
+
+  hashpos = hash%hashtbl->size;
+
+  curr_node = hashtbl->nodearray[hashpos];
+  while(curr_node) {
+    if(hash==curr_node->hash && key_size==curr_node->key_size) {
+      if(memcmp(key,node_key(curr_node),key_size)==0) {
+        return table_found(hashtbl,curr_node,data,data_size,copy,out,inserted);
+      }
+    }
+    curr_node=curr_node->next;
+  }
+
+  curr_node = (struct hashnode*)entry_alloc(hashtbl,sizeof(struct hashnode));
+  if(!curr_node) {
+    return -1;
+  }
+
+  if(node_set_key(hashtbl,curr_node,key,key_size,hash)<0) {
+    entry_free(hashtbl,curr_node,sizeof(struct hashnode));
+    return -1;
+  }
+  if(node_set_data(hashtbl,curr_node,data,data_size,copy)<0) {
+    node_release(hashtbl,curr_node);
+    entry_free(hashtbl,curr_node,sizeof(struct hashnode));
+    return -1;
+  }
+
+  curr_node->next = hashtbl->nodearray[hashpos];
+  hashtbl->nodearray[hashpos]=curr_node;
+  hashtbl->count++;
+  if(out) {
+    *out=curr_node;
+  }
+  if(inserted) {
+    *inserted=1;
+  }
+
+  /* If the bigger array can't be allocated the table still works, just
+   * with longer chains. */
+  if(hashtbl->count>hashtbl->grow_at && !hashtbl->old_nodearray) {
+    chain_start_resize(hashtbl,hashtbl->size*2);
+  }
+
+  return 0;
+}
+
+static int table_found(hashtable *hashtbl, struct hashnode *node, void *data, size_t data_size, int copy, struct hashnode **out, int *inserted) {
+  if(out) {
+    *out=node;
+  }
+  if(inserted) {
+    *inserted=0;
+    return 0;
+  }
+  return node_set_data(hashtbl,node,data,data_size,copy);
+}
+
+static void table_set_size(hashtable *hashtbl, size_t size) {
+  hashtbl->size=size;
+  hashtbl->grow_at=(size_t)(size*hashtbl->max_load);
+}
+
+static void rehash_finish(hashtable *hashtbl) {
+  if(hashtbl->flags&HASHTABLE_OPEN) {
+    open_rehash(hashtbl,SIZE_MAX);
+  }
+  else {
+    chain_rehash(hashtbl,SIZE_MAX);
+  }
+}
+
+static int chain_alloc(hashtable *hashtbl, size_t size) {
+  size_t i;
+
+  hashtbl->nodearray = (struct hashnode**)malloc(size*sizeof(struct hashnode*));
+  if(!hashtbl->nodearray) {
+    return -1;
+  }
+
+  for(i=0;i<size;i++) {
+    hashtbl->nodearray[i]=NULL;
+  }
+
+  table_set_size(hashtbl,size);
+  return 0;
+}
+
+/* Puts a new empty array in place. The old one is emptied into it bucket
+ * by bucket. */
+static int chain_start_resize(hashtable *hashtbl, size_t size) {
+  struct hashnode **old_nodearray = hashtbl->nodearray;
+  size_t old_size = hashtbl->size;
+
+  if(chain_alloc(hashtbl,size)<0) {
+    hashtbl->nodearray=old_nodearray;
+    return -1;
+  }
+
+  hashtbl->old_nodearray=old_nodearray;
+  hashtbl->old_size=old_size;
+  hashtbl->rehash_pos=0;
+  return 0;
+}
+
+static void chain_move_bucket(hashtable *hashtbl, size_t pos) {
+  struct hashnode *curr_node;
+  struct hashnode *next_node;
+  size_t hashpos;
+
+  curr_node = hashtbl->old_nodearray[pos];
+  hashtbl->old_nodearray[pos]=NULL;
+
+  while(curr_node) {
+    next_node=curr_node->next;
+    hashpos = curr_node->hash%hashtbl->size;
+    curr_node->next=hashtbl->nodearray[hashpos];
+    hashtbl->nodearray[hashpos]=curr_node;
+    curr_node=next_node;
+  }
+}
+
+static void chain_rehash(hashtable *hashtbl, size_t buckets) {
+  if(!hashtbl->old_nodearray) {
+    return;
+  }
+
+  while(buckets-- && hashtbl->rehash_pos<hashtbl->old_size) {
+    chain_move_bucket(hashtbl,hashtbl->rehash_pos++);
+  }
+
+  if(hashtbl->rehash_pos>=hashtbl->old_size) {
+    free(hashtbl->old_nodearray);
+    hashtbl->old_nodearray=NULL;
+  }
+}
+
+static void chain_free_nodes(hashtable *hashtbl, struct hashnode **nodearray, size_t size) {
+  struct hashnode *curr_node;
+  struct hashnode *next_node;
+  size_t i;
+
+  for(i=0;i<size;i++) {
+    curr_node = nodearray[i];
+    while(curr_node) {
+      next_node=curr_node->next;
+      node_release(hashtbl,curr_node);
+      entry_free(hashtbl,curr_node,sizeof(struct hashnode));
+      curr_node=next_node;
+    }
+  }
+}
+
+static void open_free_nodes(hashtable *hashtbl, uint8_t *ctrl, struct hashnode *slots, size_t size) {
+  size_t i;
+
+  for(i=0;i<size;i++) {
+    if(!(ctrl[i]&0x80)) {
+      node_release(hashtbl,&slots[i]);
+    }
+  }
+}
+
+static int open_alloc(hashtable *hashtbl, size_t capacity) {
+  hashtbl->ctrl = (uint8_t *)malloc(capacity+GROUP_WIDTH);
+  if(!hashtbl->ctrl) {
+    return -1;
+  }
+
+  hashtbl->slots = (struct hashnode *)malloc(capacity*sizeof(struct hashnode));
+  if(!hashtbl->slots) {
+    free(hashtbl->ctrl);
+    hashtbl->ctrl=NULL;
+    return -1;
+  }
+
+  memset(hashtbl->ctrl,CTRL_EMPTY,capacity+GROUP_WIDTH);
+  table_set_size(hashtbl,capacity);
+  hashtbl->deleted=0;
+  return 0;
+}
+
+static int open_start_resize(hashtable *hashtbl, size_t capacity) {
+  uint8_t *old_ctrl = hashtbl->ctrl;
+  struct hashnode *old_slots = hashtbl->slots;
+  size_t old_size = hashtbl->size;
+
+  if(open_alloc(hashtbl,capacity)<0) {
+    hashtbl->ctrl=old_ctrl;
+    hashtbl->slots=old_slots;
+    return -1;
+  }
+
+  hashtbl->old_ctrl=old_ctrl;
+  hashtbl->old_slots=old_slots;
+  hashtbl->old_size=old_size;
+  hashtbl->rehash_pos=0;
+  return 0;
+}
+
+/* Moves entries out of the old array, leaving deleted markers behind so
+ * lookups in the old array still probe past them. */
+static void open_rehash(hashtable *hashtbl, size_t slots) {
+  size_t pos;
+  size_t slot;
+  uint64_t hash;
+  struct hashnode *node;
+
+  if(!hashtbl->old_ctrl) {
+    return;
+  }
+
+  while(slots-- && hashtbl->rehash_pos<hashtbl->old_size) {
+    pos = hashtbl->rehash_pos++;
+    if(hashtbl->old_ctrl[pos]&0x80) {
+      continue;
+    }
+
+    node = &hashtbl->old_slots[pos];
+    hash = node->hash;
+    slot = open_find_free(hashtbl->ctrl,hashtbl->size,hash);
+    if(hashtbl->ctrl[slot]==CTRL_DELETED) {
+      hashtbl->deleted--;
+    }
+    hashtbl->slots[slot]=*node;
+    open_set_ctrl(hashtbl->ctrl,hashtbl->size,slot,hash&0x7f);
+    open_set_ctrl(hashtbl->old_ctrl,hashtbl->old_size,pos,CTRL_DELETED);
+  }
+
+  if(hashtbl->rehash_pos>=hashtbl->old_size) {
+    free(hashtbl->old_ctrl);
+    free(hashtbl->old_slots);
+    hashtbl->old_ctrl=NULL;
+    hashtbl->old_slots=NULL;
+  }
+}
+
+static void open_set_ctrl(uint8_t *ctrl, size_t capacity, size_t slot, uint8_t c) {
+  ctrl[slot]=c;
+  if(slot<GROUP_WIDTH) {
+    ctrl[capacity+slot]=c;
+  }
+}
+
+/* Probes whole groups, stepping a growing number of groups each time. With
+ * a power of two capacity this visits every group. */
+static size_t open_find(uint8_t *ctrl, struct hashnode *slots, size_t capacity, uint64_t hash, void *key, size_t key_size) {
+  size_t mask = capacity-1;
+  size_t pos = (size_t)(hash>>7)&mask;
+  size_t step = 0;
+  size_t slot;
+  group_mask matches;
+  struct hashnode *node;
+
+  while(1) {
+    matches = group_match(ctrl+pos,hash&0x7f);
+    while(matches) {
+      slot = (pos+group_first(matches))&mask;
+      node = &slots[slot];
+      if(node->hash==hash && node->key_size==key_size && memcmp(node_key(node),key,key_size)==0) {
+        return slot;
+      }
+      matches &= matches-1;
+    }
+
+    if(group_match(ctrl+pos,CTRL_EMPTY)) {
+      return NOT_FOUND;
+    }
+
+    step += GROUP_WIDTH;
+    pos = (pos+step)&mask;
+  }
+}
+
+static size_t open_find_free(uint8_t *ctrl, size_t capacity, uint64_t hash) {
+  size_t mask = capacity-1;
+  size_t pos = (size_t)(hash>>7)&mask;
+  size_t step = 0;
+  group_mask matches;
+
+  while(1) {
+    matches = group_match_free(ctrl+pos);
+    if(matches) {
+      return (pos+group_first(matches))&mask;
+    }
+
+    step += GROUP_WIDTH;
+    pos = (pos+step)&mask;
+  }
+}
+
+/* Smallest power of two capacity holding count entries at the max load. */
+static size_t open_capacity(hashtable *hashtbl, size_t count) {
+  size_t capacity;
+
+  for(capacity=MIN_CAPACITY;count>(size_t)(capacity*hashtbl->max_load);capacity*=2);
+  return capacity;
+}
+
+/* Makes sure one more entry fits while keeping enough slots empty that
+ * probes end quickly. A table with many deleted slots is rebuilt at the
+ * same size, otherwise the capacity doubles. Either way the entries move
+ * over during later calls. */
+static int open_make_room(hashtable *hashtbl) {
+  size_t capacity = hashtbl->size;
+
+  if(hashtbl->count+hashtbl->deleted+1 <= hashtbl->grow_at) {
+    return 0;
+  }
+
+  rehash_finish(hashtbl);
+
+  if(hashtbl->count+1 > hashtbl->grow_at/2) {
+    capacity *= 2;
+  }
+
+  if(open_start_resize(hashtbl,capacity)<0) {
+    /* Still fine as long as an empty slot is left to end probes. */
+    return hashtbl->count+hashtbl->deleted+1 < hashtbl->size ? 0 : -1;
+  }
+
+  open_rehash(hashtbl,REHASH_SLOTS);
+  return 0;
+}
+
+static uint64_t snapshot_align(uint64_t offset) {
+  return (offset+SNAPSHOT_ALIGN-1)/SNAPSHOT_ALIGN*SNAPSHOT_ALIGN;
+}
+
+/* Writes the zeros that bring something of size bytes up to the next
+ * multiple of SNAPSHOT_ALIGN. */
+static int snapshot_pad(FILE *file, uint64_t size) {
+  static const uint8_t zeros[SNAPSHOT_ALIGN];
+  size_t pad = snapshot_align(size)-size;
+
+  return fwrite(zeros,1,pad,file)==pad ? 0 : -1;
+}
+
+/* Fills in the checksum of a file just written, reading it back through a
+ * mapping as mulmix64 needs the whole of it at once. */
+static int snapshot_sum(const char *path) {
+  struct stat st;
+  uint64_t checksum;
+  uint8_t *map;
+  int fd;
+  int ret = -1;
+
+  fd = open(path,O_RDWR);
+  if(fd<0) {
+    return -1;
+  }
+  if(fstat(fd,&st)==0) {
+    map = (uint8_t *)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    if(map!=MAP_FAILED) {
+      checksum = mulmix64(map+sizeof(struct snapshot_header),st.st_size-sizeof(struct snapshot_header));
+      munmap(map,st.st_size);
+      if(pwrite(fd,&checksum,sizeof(checksum),offsetof(struct snapshot_header,checksum))==sizeof(checksum) && fsync(fd)==0) {
+        ret=0;
+      }
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+/* Everything hashtable_map can check without reading past the header:
+ * that the file is a snapshot of this version and byte order, written with
+ * the same hash function, and that its arrays lie inside the file. */
+static int snapshot_check(struct snapshot_header *header, size_t file_size, uint64_t (*hashfunc)(void *, size_t)) {
+  uint64_t capacity = header->capacity;
+
+  if(memcmp(header->magic,SNAPSHOT_MAGIC,sizeof(header->magic))!=0) {
+    return -1;
+  }
+  if(header->byte_order!=SNAPSHOT_BYTE_ORDER || header->version!=SNAPSHOT_VERSION) {
+    return -1;
+  }
+  if(header->slot_size!=sizeof(struct snapshot_slot) || header->file_size!=file_size) {
+    return -1;
+  }
+  if(capacity<MIN_CAPACITY || (capacity&(capacity-1)) || capacity>file_size/sizeof(struct snapshot_slot)) {
+    return -1;
+  }
+  if(header->count>=capacity) {
+    return -1;
+  }
+  if(header->ctrl_offset<sizeof(struct snapshot_header) || header->slots_offset%SNAPSHOT_ALIGN) {
+    return -1;
+  }
+  if(header->ctrl_offset+capacity+GROUP_WIDTH>header->slots_offset) {
+    return -1;
+  }
+  if(header->slots_offset>file_size || capacity*sizeof(struct snapshot_slot)>file_size-header->slots_offset) {
+    return -1;
+  }
+  if(header->blob_offset<header->slots_offset+capacity*sizeof(struct snapshot_slot) || header->blob_offset>file_size) {
+    return -1;
+  }
+  if(header->hash_check!=hashfunc(SNAPSHOT_CHECK,sizeof(SNAPSHOT_CHECK)-1)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* open_find for the slots of a mapped table. */
+static size_t map_find(hashtable *hashtbl, uint64_t hash, void *key, size_t key_size) {
+  size_t mask = hashtbl->size-1;
+  size_t pos = (size_t)(hash>>7)&mask;
+  size_t step = 0;
+  size_t slot;
+  group_mask matches;
+  struct snapshot_entry *entry;
+
+  while(1) {
+    matches = group_match(hashtbl->ctrl+pos,hash&0x7f);
+    while(matches) {
+      slot = (pos+group_first(matches))&mask;
+      if(hashtbl->map_slots[slot].hash==hash) {
+        entry = map_entry(hashtbl,slot);
+        if(entry->key_size==key_size && memcmp(map_key(entry),key,key_size)==0) {
+          return slot;
+        }
+      }
+      matches &= matches-1;
+    }
+
+    if(group_match(hashtbl->ctrl+pos,CTRL_EMPTY)) {
+      return NOT_FOUND;
+    }
+
+    step += GROUP_WIDTH;
+    pos = (pos+step)&mask;
+  }
+}
+
+/* Checks the checksum, then every control byte and slot: that entries lie
+ * within the file, that the count is right, which also leaves an empty
+ * slot to end probes, and then that each key hashes to its stored hash and
+ * is found in its own slot, which rules out duplicates. */
+static int map_validate(hashtable *hashtbl) {
+  struct snapshot_header *header = (struct snapshot_header *)hashtbl->map;
+  struct snapshot_slot *slot;
+  struct snapshot_entry *entry;
+  size_t file_size = hashtbl->map_size;
+  uint64_t left;
+  size_t count = 0;
+  size_t i;
+  uint8_t c;
+
+  if(mulmix64(hashtbl->map+sizeof(struct snapshot_header),file_size-sizeof(struct snapshot_header))!=header->checksum) {
+    return -1;
+  }
+
+  for(i=0;i<hashtbl->size;i++) {
+    c = hashtbl->ctrl[i];
+    if(i<GROUP_WIDTH && hashtbl->ctrl[hashtbl->size+i]!=c) {
+      return -1;
+    }
+    if(c==CTRL_EMPTY) {
+      continue;
+    }
+
+    slot = &hashtbl->map_slots[i];
+    if(c!=(slot->hash&0x7f)) {
+      return -1;
+    }
+    if(slot->entry_offset<header->blob_offset || slot->entry_offset%SNAPSHOT_ALIGN) {
+      return -1;
+    }
+    if(slot->entry_offset>file_size || sizeof(struct snapshot_entry)>file_size-slot->entry_offset) {
+      return -1;
+    }
+    entry = map_entry(hashtbl,i);
+    left = file_size-slot->entry_offset-sizeof(struct snapshot_entry);
+    if(entry->key_size>left || snapshot_align(entry->key_size)>left) {
+      return -1;
+    }
+    if(entry->data_size>left-snapshot_align(entry->key_size)) {
+      return -1;
+    }
+    count++;
+  }
+  if(count!=hashtbl->count) {
+    return -1;
+  }
+
+  for(i=0;i<hashtbl->size;i++) {
+    if(hashtbl->ctrl[i]&0x80) {
+      continue;
+    }
+    entry = map_entry(hashtbl,i);
+    if(hashtbl->hashfunc(map_key(entry),entry->key_size)!=hashtbl->map_slots[i].hash) {
+      return -1;
+    }
+    if(map_find(hashtbl,hashtbl->map_slots[i].hash,map_key(entry),entry->key_size)!=i) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static inline struct snapshot_entry *map_entry(hashtable *hashtbl, size_t slot) {
+  return (struct snapshot_entry *)(hashtbl->map+hashtbl->map_slots[slot].entry_offset);
+}
+
+static inline void *map_key(struct snapshot_entry *entry) {
+  return (uint8_t *)(entry+1);
+}
+
+static inline void *map_data(struct snapshot_entry *entry) {
+  return (uint8_t *)(entry+1)+snapshot_align(entry->key_size);
+}
+
+static struct snapshot_entry *map_iterator_entry(hashtable_iterator *iterator) {
+  if(iterator->table_row>=iterator->iterating_table->size) {
+    return NULL;
+  }
+  return map_entry(iterator->iterating_table,iterator->table_row);
+}
+
+/* Maps a hash onto 0 to n-1 using its high bits, without a division. */
+static inline size_t frozen_range(uint64_t hash, size_t n) {
+#if defined(__SIZEOF_INT128__)
+  return (size_t)(((__uint128_t)hash*n)>>64);
+#else
+  return (size_t)(((hash>>32)*(uint64_t)n)>>32);
+#endif
+}
+
+/* The one slot a key with this hash can be in, given its bucket's seed. */
+static inline size_t frozen_slot(uint64_t hash, uint16_t seed, size_t slots) {
+  return frozen_range(mix_fold(hash^mix_k1,mix_k0^(seed*mix_k2)),slots);
+}
+
+static inline size_t frozen_find(hashtable *hashtbl, uint64_t hash, void *key, size_t key_size) {
+  struct hashfrozen *frozen = hashtbl->frozen;
+  struct hashnode *node;
+  size_t pos;
+
+  if(hashtbl->count==0) {
+    return NOT_FOUND;
+  }
+
+  pos = frozen_slot(hash,frozen->seeds[frozen_range(hash,frozen->buckets)],frozen->slots);
+  if(pos>=hashtbl->count) {
+    pos = frozen->remap[pos-hashtbl->count];
+  }
+  node = &hashtbl->slots[pos];
+  if(node->hash==hash && node->key_size==key_size && memcmp(node_key(node),key,key_size)==0) {
+    return pos;
+  }
+  return NOT_FOUND;
+}
+
+/* Places the buckets largest first, while most slots are free, so the
+ * many single key buckets at the end each need a free slot for one key
+ * only. Keys with the same full hash always land on the same slot, and
+ * give up after FROZEN_MAX_SEED seeds. The hashes are copied out in
+ * bucket order first so that trying a seed reads them one after another
+ * rather than all over the array. Once every key has a slot, the
+ * slots in use from n up are paired off in order with the free ones below
+ * n. */
+static int frozen_build(struct hashfrozen *frozen, uint64_t *hashes, size_t n, size_t *slot_of) {
+  uint64_t *taken;
+  uint64_t *sorted;
+  size_t *placed;
+  size_t *start;
+  size_t *members;
+  size_t *order;
+  size_t *by_size;
+  size_t max_size = 0;
+  size_t b, i, j, k, slot, seed, total;
+  int ret = 0;
+
+  frozen->buckets=n/FROZEN_BUCKET_KEYS+1;
+  frozen->slots=n+n/FROZEN_SLACK+1;
+  frozen->seeds=(uint16_t *)calloc(frozen->buckets,sizeof(uint16_t));
+  frozen->remap=(size_t *)calloc(frozen->slots-n,sizeof(size_t));
+  taken = (uint64_t *)calloc((frozen->slots+63)/64,sizeof(uint64_t));
+  start = (size_t *)calloc(frozen->buckets+1,sizeof(size_t));
+  members = (size_t *)malloc((n+1)*sizeof(size_t));
+  sorted = (uint64_t *)malloc((n+1)*sizeof(uint64_t));
+  placed = (size_t *)malloc((n+1)*sizeof(size_t));
+  order = (size_t *)malloc(frozen->buckets*sizeof(size_t));
+  if(!frozen->seeds || !frozen->remap || !taken || !start || !members || !sorted || !placed || !order) {
+    free(taken);
+    free(sorted);
+    free(placed);
+    free(start);
+    free(members);
+    free(order);
+    return -1;
+  }
+
+  /* Group the keys by bucket, counting sort style. */
+  for(i=0;i<n;i++) {
+    start[frozen_range(hashes[i],frozen->buckets)+1]++;
+  }
+  for(b=0;b<frozen->buckets;b++) {
+    if(start[b+1]>max_size) {
+      max_size=start[b+1];
+    }
+    start[b+1]+=start[b];
+  }
+  memcpy(order,start,frozen->buckets*sizeof(size_t));
+  for(i=0;i<n;i++) {
+    j=order[frozen_range(hashes[i],frozen->buckets)]++;
+    members[j]=i;
+    sorted[j]=hashes[i];
+  }
+
+  /* Then sort the buckets by size, largest first. */
+  by_size = (size_t *)calloc(max_size+1,sizeof(size_t));
+  if(!by_size) {
+    free(taken);
+    free(sorted);
+    free(placed);
+    free(start);
+    free(members);
+    free(order);
+    return -1;
+  }
+  for(b=0;b<frozen->buckets;b++) {
+    by_size[max_size-(start[b+1]-start[b])]++;
+  }
+  for(k=0,total=0;k<=max_size;k++) {
+    i=by_size[k];
+    by_size[k]=total;
+    total+=i;
+  }
+  for(b=0;b<frozen->buckets;b++) {
+    order[by_size[max_size-(start[b+1]-start[b])]++]=b;
+  }
+
+  for(i=0;i<frozen->buckets;i++) {
+    b=order[i];
+    k=start[b+1]-start[b];
+    if(k==0) {
+      break;
+    }
+
+    for(seed=0;seed<=FROZEN_MAX_SEED;seed++) {
+      for(j=0;j<k;j++) {
+        slot=frozen_slot(sorted[start[b]+j],seed,frozen->slots);
+        if(taken[slot>>6]&(UINT64_C(1)<<(slot&63))) {
+          break;
+        }
+        taken[slot>>6]|=UINT64_C(1)<<(slot&63);
+        placed[start[b]+j]=slot;
+      }
+      if(j==k) {
+        break;
+      }
+      while(j--) {
+        slot=placed[start[b]+j];
+        taken[slot>>6]&=~(UINT64_C(1)<<(slot&63));
+      }
+    }
+
+    if(seed>FROZEN_MAX_SEED) {
+      ret=-1;
+      break;
+    }
+    frozen->seeds[b]=(uint16_t)seed;
+  }
+
+  for(i=0;ret==0 && i<n;i++) {
+    slot_of[members[i]]=placed[i];
+  }
+
+  for(slot=n,j=0;ret==0 && slot<frozen->slots;slot++) {
+    if(!(taken[slot>>6]&(UINT64_C(1)<<(slot&63)))) {
+      continue;
+    }
+    while(taken[j>>6]&(UINT64_C(1)<<(j&63))) {
+      j++;
+    }
+    frozen->remap[slot-n]=j++;
+  }
+
+  free(taken);
+  free(sorted);
+  free(placed);
+  free(start);
+  free(members);
+  free(order);
+  free(by_size);
+  return ret;
+}
+
+static struct hashsync *sync_create(void) {
+  struct hashsync *sync;
+  int i;
+
+  if(posix_memalign((void **)&sync,CACHE_LINE,sizeof(struct hashsync))!=0) {
+    return NULL;
+  }
+  memset(sync,0,sizeof(struct hashsync));
+
+  for(i=0;i<SYNC_STRIPES;i++) {
+    pthread_mutex_init(&sync->stripes[i].lock,NULL);
+  }
+  pthread_mutex_init(&sync->retire_lock,NULL);
+
+  return sync;
+}
+
+static void sync_free(hashtable *hashtbl) {
+  struct hashsync *sync = hashtbl->sync;
+  size_t i;
+
+  for(i=0;i<sync->nretired;i++) {
+    node_release(hashtbl,sync->retired[i]);
+    entry_free(hashtbl,sync->retired[i],sizeof(struct hashnode));
+  }
+  free(sync->retired);
+  for(i=0;i<sync->nstale;i++) {
+    free(sync->stale[i]);
+  }
+  free(sync->stale);
+
+  for(i=0;i<SYNC_STRIPES;i++) {
+    pthread_mutex_destroy(&sync->stripes[i].lock);
+  }
+  pthread_mutex_destroy(&sync->retire_lock);
+  free(sync);
+}
+
+/* Call with retire_lock held. Anything unlinked before this is called is
+ * no longer visible to any reader when it returns. */
+static void sync_wait_readers(struct hashsync *sync) {
+  unsigned long phase;
+  int flip, i;
+
+  for(flip=0;flip<2;flip++) {
+    phase = __atomic_fetch_add(&sync->epoch,1,__ATOMIC_SEQ_CST)&1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(i=0;i<SYNC_READER_SLOTS;i++) {
+      while(__atomic_load_n(&sync->readers[i].count[phase],__ATOMIC_ACQUIRE)) {
+        sched_yield();
+      }
+    }
+  }
+}
+
+static void sync_retire(hashtable *hashtbl, struct hashnode *node) {
+  struct hashsync *sync = hashtbl->sync;
+  struct hashnode **retired;
+
+  pthread_mutex_lock(&sync->retire_lock);
+
+  if(sync->nretired==sync->retired_size) {
+    retired = (struct hashnode **)realloc(sync->retired,(sync->retired_size+SYNC_RETIRE_BATCH)*sizeof(struct hashnode *));
+    if(retired) {
+      sync->retired=retired;
+      sync->retired_size+=SYNC_RETIRE_BATCH;
+    }
+    else if(!reader_depth) {
+      /* No room to queue it, so wait for the readers right away. */
+      sync_wait_readers(sync);
+      node_release(hashtbl,node);
+      entry_free(hashtbl,node,sizeof(struct hashnode));
+      node=NULL;
+    }
+    else {
+      /* Nowhere to keep it and no way to wait, so it leaks. */
+      node=NULL;
+    }
+  }
+
+  if(node) {
+    sync->retired[sync->nretired++]=node;
+  }
+
+  if(sync->nretired>=SYNC_RETIRE_BATCH && !reader_depth) {
+    sync_reclaim(hashtbl);
+  }
+
+  pthread_mutex_unlock(&sync->retire_lock);
+}
+
+/* Call with retire_lock held and outside any read section. Frees every
+ * queued node and old bucket array once no reader can be looking at them. */
+static void sync_reclaim(hashtable *hashtbl) {
+  struct hashsync *sync = hashtbl->sync;
+  size_t i;
+
+  sync_wait_readers(sync);
+  for(i=0;i<sync->nretired;i++) {
+    node_release(hashtbl,sync->retired[i]);
+    entry_free(hashtbl,sync->retired[i],sizeof(struct hashnode));
+  }
+  sync->nretired=0;
+  for(i=0;i<sync->nstale;i++) {
+    free(sync->stale[i]);
+  }
+  sync->nstale=0;
+}
+
+/* Grows the bucket array to size if it is still smaller once every stripe
+ * is held. The new array is published before its size, so a reader never
+ * pairs the new size with the old, shorter array. */
+static int sync_grow(hashtable *hashtbl, size_t size) {
+  struct hashsync *sync = hashtbl->sync;
+  struct hashnode **old_nodearray;
+  struct hashnode **nodearray;
+  struct hashnode ***stale;
+  struct hashnode *curr_node;
+  struct hashnode *next_node;
+  size_t old_size;
+  size_t hashpos;
+  size_t i;
+  int ret = 0;
+
+  for(i=0;i<SYNC_STRIPES;i++) {
+    pthread_mutex_lock(&sync->stripes[i].lock);
+  }
+
+  old_nodearray = hashtbl->nodearray;
+  old_size = hashtbl->size;
+
+  if(old_size<size) {
+    nodearray = (struct hashnode **)calloc(size,sizeof(struct hashnode *));
+    if(!nodearray) {
+      ret = -1;
+    }
+    else {
+      __atomic_add_fetch(&sync->resizing,1,__ATOMIC_SEQ_CST);
+      __atomic_store_n(&hashtbl->nodearray,nodearray,__ATOMIC_RELEASE);
+      __atomic_store_n(&hashtbl->size,size,__ATOMIC_RELEASE);
+      __atomic_store_n(&hashtbl->grow_at,(size_t)(size*hashtbl->max_load),__ATOMIC_RELAXED);
+
+      for(i=0;i<old_size;i++) {
+        curr_node = old_nodearray[i];
+        while(curr_node) {
+          next_node=curr_node->next;
+          hashpos = curr_node->hash%size;
+          __atomic_store_n(&curr_node->next,nodearray[hashpos],__ATOMIC_RELEASE);
+          __atomic_store_n(&nodearray[hashpos],curr_node,__ATOMIC_RELEASE);
+          curr_node=next_node;
+        }
+      }
+
+      __atomic_add_fetch(&sync->resizing,1,__ATOMIC_SEQ_CST);
+    }
+  }
+
+  for(i=0;i<SYNC_STRIPES;i++) {
+    pthread_mutex_unlock(&sync->stripes[i].lock);
+  }
+
+  if(old_size<size && ret==0) {
+    pthread_mutex_lock(&sync->retire_lock);
+    if(!reader_depth) {
+      sync_reclaim(hashtbl);
+      free(old_nodearray);
+    }
+    else {
+      if(sync->nstale==sync->stale_size) {
+        stale = (struct hashnode ***)realloc(sync->stale,(sync->stale_size*2+1)*sizeof(struct hashnode **));
+        if(stale) {
+          sync->stale=stale;
+          sync->stale_size=sync->stale_size*2+1;
+        }
+      }
+      /* If there was no room the old array leaks */
+      if(sync->nstale<sync->stale_size) {
+        sync->stale[sync->nstale++]=old_nodearray;
+      }
+    }
+    pthread_mutex_unlock(&sync->retire_lock);
+  }
+
+  return ret;
+}
+
+/* Builds the node before taking the lock. An existing node is swapped for
+ * the new one rather than changed, since readers may be looking at it. */
+static int sync_put(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size, int copy, uint64_t hash) {
+  pthread_mutex_t *lock = &hashtbl->sync->stripes[hash%SYNC_STRIPES].lock;
+  struct hashnode *new_node;
+  struct hashnode *curr_node;
+  struct hashnode **link;
+  size_t size;
+  size_t count = 0;
+
+  new_node = (struct hashnode*)entry_alloc(hashtbl,sizeof(struct hashnode));
+  if(!new_node) {
+    return -1;
+  }
+  if(node_set_key(hashtbl,new_node,key,key_size,hash)<0) {
+    entry_free(hashtbl,new_node,sizeof(struct hashnode));
+    return -1;
+  }
+  if(node_set_data(hashtbl,new_node,data,data_size,copy)<0) {
+    node_release(hashtbl,new_node);
+    entry_free(hashtbl,new_node,sizeof(struct hashnode));
+    return -1;
+  }
+
+  pthread_mutex_lock(lock);
+
+  size = hashtbl->size;
+  link = &hashtbl->nodearray[hash%size];
+  for(curr_node=*link;curr_node;curr_node=curr_node->next) {
+    if(hash==curr_node->hash && key_size==curr_node->key_size) {
+      if(memcmp(key,node_key(curr_node),key_size)==0) {
+        break;
+      }
+    }
+    link=&curr_node->next;
+  }
+
+  if(curr_node) {
+    new_node->next=curr_node->next;
+  }
+  else {
+    link = &hashtbl->nodearray[hash%size];
+    new_node->next=*link;
+    count = __atomic_add_fetch(&hashtbl->count,1,__ATOMIC_RELAXED);
+  }
+  __atomic_store_n(link,new_node,__ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(lock);
+
+  if(curr_node) {
+    sync_retire(hashtbl,curr_node);
+  }
+  else if(count>__atomic_load_n(&hashtbl->grow_at,__ATOMIC_RELAXED)) {
+    sync_grow(hashtbl,size*2);
+  }
+
+  return 0;
+}
+
+static int sync_remove(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash) {
+  pthread_mutex_t *lock = &hashtbl->sync->stripes[hash%SYNC_STRIPES].lock;
+  struct hashnode *curr_node;
+  struct hashnode **link;
+
+  pthread_mutex_lock(lock);
+
+  link = &hashtbl->nodearray[hash%hashtbl->size];
+  for(curr_node=*link;curr_node;curr_node=curr_node->next) {
+    if(hash==curr_node->hash && key_size==curr_node->key_size) {
+      if(memcmp(key,node_key(curr_node),key_size)==0) {
+        break;
+      }
+    }
+    link=&curr_node->next;
+  }
+
+  if(curr_node) {
+    __atomic_store_n(link,curr_node->next,__ATOMIC_RELEASE);
+    __atomic_sub_fetch(&hashtbl->count,1,__ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(lock);
+
+  if(!curr_node) {
+    return -1;
+  }
+  sync_retire(hashtbl,curr_node);
+  return 0;
+}
+
+/* Unlinks every chain with all the stripes held, joining them into one
+ * list to retire once the locks are released. A reader still walking a
+ * chain may follow the join into another, where its hash and key checks
+ * keep it from matching anything. */
+static void sync_clear(hashtable *hashtbl) {
+  struct hashsync *sync = hashtbl->sync;
+  struct hashnode *cleared = NULL;
+  struct hashnode *head;
+  struct hashnode *curr_node;
+  struct hashnode *next_node;
+  size_t i;
+
+  for(i=0;i<SYNC_STRIPES;i++) {
+    pthread_mutex_lock(&sync->stripes[i].lock);
+  }
+
+  for(i=0;i<hashtbl->size;i++) {
+    head = hashtbl->nodearray[i];
+    if(!head) {
+      continue;
+    }
+    __atomic_store_n(&hashtbl->nodearray[i],NULL,__ATOMIC_RELEASE);
+    for(curr_node=head;curr_node->next;curr_node=curr_node->next);
+    __atomic_store_n(&curr_node->next,cleared,__ATOMIC_RELEASE);
+    cleared = head;
+  }
+  __atomic_store_n(&hashtbl->count,0,__ATOMIC_RELAXED);
+
+  for(i=0;i<SYNC_STRIPES;i++) {
+    pthread_mutex_unlock(&sync->stripes[i].lock);
+  }
+
+  for(curr_node=cleared;curr_node;curr_node=next_node) {
+    next_node=curr_node->next;
+    sync_retire(hashtbl,curr_node);
+  }
+}
+
+/* A miss only counts if no resize ran while looking. The size is read
+ * before the array, so it never indexes past the end of the array. */
+static struct hashnode *sync_find(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash) {
+  struct hashsync *sync = hashtbl->sync;
+  struct hashnode **nodearray;
+  struct hashnode *curr_node;
+  unsigned long resizing;
+  size_t size;
+  int token;
+
+  token = hashtable_read_begin(hashtbl);
+
+  while(1) {
+    resizing = __atomic_load_n(&sync->resizing,__ATOMIC_ACQUIRE);
+    size = __atomic_load_n(&hashtbl->size,__ATOMIC_ACQUIRE);
+    nodearray = __atomic_load_n(&hashtbl->nodearray,__ATOMIC_ACQUIRE);
+
+    curr_node = __atomic_load_n(&nodearray[hash%size],__ATOMIC_ACQUIRE);
+    while(curr_node) {
+      if(hash==curr_node->hash && key_size==curr_node->key_size) {
+        if(memcmp(key,node_key(curr_node),key_size)==0) {
+          break;
+        }
+      }
+      curr_node = __atomic_load_n(&curr_node->next,__ATOMIC_ACQUIRE);
+    }
+
+    if(curr_node || (!(resizing&1) && __atomic_load_n(&sync->resizing,__ATOMIC_ACQUIRE)==resizing)) {
+      break;
+    }
+    sched_yield();
+  }
+
+  hashtable_read_end(hashtbl,token);
+  return curr_node;
+}
@@ -2,6 +2,7 @@
 #define _HASHTABLE_H
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*****************************************************************************
  * This library defines a generic hashtable. Both the key and data can be any
@@ -16,46 +17,281 @@
  * This command creates a hashtable of size size with an optional hashfunction
  * that you can define. If you choose NULL for the hashfunction, it will 
  * default to a 64 bit FNV-1a hash. The hash function should return a 64 bit
- * unsigned integer. The size is merely the size of the hash array. More
- * elements can be added, in the event of a hash collision the second hash is
- * added to the same hash bucket. The hashtable_create function returns a
- * pointer to a hashtable or NULL if it fails.
+ * unsigned integer. The size is merely the starting size of the hash array.
+ * More elements can be added, in the event of a hash collision the second
+ * hash is added to the same hash bucket. Once there are more elements than
+ * buckets (see hashtable_set_max_load) the array doubles in size. The
+ * elements are moved over a few buckets at a time by later insert, get and
+ * remove calls, so no single call pays for the whole rehash. The
+ * hashtable_create function returns a pointer to a hashtable or NULL if it
+ * fails.
+ *
+ * There are three built in hash functions to pass as hashfunc. fnv1a64 is
+ * the default and works a byte at a time. mulmix64 works a word at a time
+ * and is several times faster for keys longer than a few bytes. inthash64
+ * is for keys that are 4 or 8 byte integers, and falls back to mulmix64 for
+ * other key sizes. hashbench -t hash compares them.
+ *
+ * hashtable_create_flags:
+ * Like hashtable_create but selects the table layout with flags. With
+ * HASHTABLE_CHAINED (0) this is the same as hashtable_create. With
+ * HASHTABLE_OPEN the entries are kept in place in one flat array using open
+ * addressing. A byte of metadata per slot holds seven bits of the hash, so
+ * lookups compare 16 slots at a time using SSE2 or NEON where available.
+ * The size is rounded up to a power of two of at least 16, and the table
+ * grows by itself once it is 7/8 full. Here only insert and remove calls
+ * move entries during a resize, so hashtable_get never writes to the table.
+ * The rest of the API works the same way for both layouts.
+ *
+ * Adding HASHTABLE_POOL to either layout makes the table allocate keys,
+ * data and chain nodes from its own slabs rather than calling malloc for
+ * each one, and hashtable_free then releases them all at once. The
+ * allocations field counts the calls the table made to malloc for entries,
+ * with or without the pool.
+ *
+ * hashtable_set_max_load:
+ * Sets the number of elements per bucket (or slot) above which the table
+ * grows. The default is 1.0 for chained tables and 0.875 for open tables,
+ * which is also the largest load an open table accepts. Returns <0 if the
+ * load is out of range.
+ *
+ * hashtable_reserve:
+ * Sizes the table to hold count elements without growing again, finishing
+ * any resize in progress. Call it up front when the size of the workload is
+ * known, as it rehashes everything in one go. Returns <0 on error.
+ *
+ * Adding HASHTABLE_CONCURRENT to a chained table lets several threads share
+ * it. Writers lock one of 16 stripes, so writes to different buckets
+ * mostly run in parallel, and readers never lock. Replaced and removed
+ * entries are freed only once no reader can still be looking at them.
+ * hashtable_get on its own is safe, but the data it points to can be freed
+ * by another thread at any time, so either use the pointer between
+ * hashtable_read_begin and hashtable_read_end or copy the data out with
+ * hashtable_get_copy. It can't be combined with HASHTABLE_OPEN or
+ * HASHTABLE_POOL (hashtable_create_flags returns NULL), iterating is only
+ * safe when no other thread writes, and a concurrent table grows in one
+ * pass with every stripe held rather than incrementally.
  *
  * hashtable_insert:
  * This will insert new data or overwrite old data (with the same key). It 
- * copies both the key and data into newly allocated memory. The key and data
- * can be anything. The function returns <0 on error.
+ * copies both the key and data into newly allocated memory, or over the old
+ * data if it is the same size. The key and data can be anything. The
+ * function returns <0 on error.
  *
  * hashtable_insertref:
  * This is like hashtable_insert except that it only adds a pointer to the
  * data structure, and does not copy the data itself.
  *
+ * hashtable_emplace:
+ * Returns a pointer to data_size bytes of storage for key inside the
+ * table, adding the key with zeroed data if it isn't there yet, so a value
+ * can be updated in place with one hash and no copying. If inserted isn't
+ * NULL it is set to 1 when the key was added and 0 when it was already
+ * there. If the key holds data of another size (or a reference) it gets
+ * data_size bytes that start with as much of the old data as fits, the
+ * rest zeroed. The storage is aligned to 8 bytes and stays valid as long
+ * as a pointer from hashtable_get would. Returns NULL on error, and for
+ * concurrent, mapped and frozen tables.
+ *
+ * hashtable_get_or_insert:
+ * Returns a pointer to the data for key, first inserting a copy of data if
+ * the key isn't there. Existing data is left as it is. Returns NULL on
+ * error, and for concurrent, mapped and frozen tables.
+ *
  * hashtable_remove:
  * Removes an item from the hashtable and frees the relevant memory. Returns
  * <0 if unsuccessful.
  *
  * hashtable_get:
  * Returns a pointer to the data associated with the key or NULL if the value
- * was not found.
+ * was not found. Copied data of 16 bytes or less lives inside the table
+ * entry, so with HASHTABLE_OPEN the pointer is only good until the next
+ * insert or remove, which may move entries. In every layout the pointer to
+ * copied data goes stale once the key is overwritten or removed.
+ *
+ * hashtable_get_many:
+ * Looks up n keys of key_size bytes each, laid out one after another in
+ * keys, and stores a pointer to each one's data (or NULL) in out. Returns
+ * how many were found. It hashes and prefetches a batch of keys before
+ * looking any of them up, so the cache misses of a batch overlap rather
+ * than coming one after another.
+ *
+ * hashtable_get_copy:
+ * Copies out_size bytes of the data for key into out. Returns <0 if the key
+ * was not found. This is the simple way to read a concurrent table.
+ *
+ * hashtable_read_begin, hashtable_read_end:
+ * Bracket a read of a concurrent table. Data pointers returned by
+ * hashtable_get stay valid until hashtable_read_end, which takes the value
+ * returned by hashtable_read_begin. Keep these sections short, as writers
+ * that free memory wait for them. Sections can nest, and a thread may write
+ * to a table from inside one, but the entries and bucket arrays such a
+ * write frees are only reclaimed by a later write made outside every read
+ * section. Both do nothing for other tables.
+ *
+ * hashtable_hash:
+ * Returns the hash the table uses for a key.
+ *
+ * hashtable_get_prehashed, hashtable_insert_prehashed,
+ * hashtable_remove_prehashed:
+ * The same as hashtable_get, hashtable_insert and hashtable_remove but take
+ * the hash of the key from the caller, who can then hash a key once and use
+ * it many times. The hash must be the one hashtable_hash returns for the
+ * key, otherwise the key won't be found.
+ *
+ * hashtable_stats:
+ * Fills in a hashtable_stats structure: the number of entries, buckets (or
+ * slots) and the load, the deleted slots of an open table, the heap bytes
+ * the table holds (not counting malloc's own overhead) and a histogram of
+ * lengths. For chained tables lengths[i] is the number of buckets holding i
+ * entries, for open tables it is the number of entries found in the i'th
+ * group probed, so lengths[0] counts the entries in their home group. The
+ * last element also counts everything longer, and max_length is the
+ * longest. Finishes any resize in progress, and walks the whole table, so
+ * don't call it while other threads write.
+ *
+ * hashtable_snapshot:
+ * Writes the table to the file at path in a flat format that hashtable_map
+ * can open. The keys and data are copied into the file, so a table holding
+ * data added with hashtable_insertref can't be written. The file is written
+ * under a temporary name in the same directory, synced and renamed over
+ * path, so tables already mapped from path, even in other processes, keep
+ * the old contents. Returns <0 on error.
+ *
+ * hashtable_map:
+ * Opens a file written by hashtable_snapshot as a read-only table. The file
+ * is mapped into memory with mmap and looked up in place, so opening takes
+ * the same time for any size of table and nothing is copied. hashfunc must
+ * be the one the table was written with (NULL for the default), which is
+ * checked against a value in the file. The header is always checked, and
+ * the file must have been written on a machine with the same byte order.
+ * If validate is nonzero the checksum of the file and every entry are also
+ * checked, which reads the whole file, so only skip it for files you trust.
+ * Returns NULL on error. A mapped table has the HASHTABLE_MAPPED flag set.
+ * hashtable_get and the other lookups, the iterator, hashtable_stats (which
+ * counts the file in bytes) and hashtable_snapshot work as usual, while
+ * insert, remove, hashtable_set_max_load and hashtable_reserve return <0.
+ * Data pointers point into the mapping, stay valid until hashtable_free,
+ * and must not be written through. Data is aligned to 8 bytes.
+ *
+ * hashtable_freeze:
+ * Builds a read-only copy of a table that is done changing, laid out as a
+ * minimal perfect hash: the entries sit in one array with no empty slots,
+ * and every lookup goes to the one place its key can be and compares one
+ * key, with no probing and no chains. Building takes about as long as
+ * inserting the entries did, and the table it came from is left as it
+ * was, to be freed by the caller. Returns NULL on error, which includes
+ * two keys with the same 64 bit hash. A frozen table has the
+ * HASHTABLE_FROZEN flag set, and like a mapped table it supports the
+ * lookups, the iterator, hashtable_foreach, hashtable_stats and
+ * hashtable_snapshot, while everything that changes it returns <0 or NULL.
+ * Data pointers stay valid until hashtable_free. hashbench -t freeze
+ * compares it with the live tables.
+ *
+ * hashtable_iterator_create:
+ * Creates an iterator over the table, finishing any resize in progress
+ * first. Don't insert or remove elements while iterating.
+ *
+ * hashtable_iterator_init:
+ * Sets up an iterator the caller has allocated, usually on the stack, the
+ * same way as hashtable_iterator_create. Such an iterator needs no
+ * hashtable_iterator_free.
+ *
+ * hashtable_foreach:
+ * Calls visit with the key, data and ctx of every element, in the order
+ * they lie in the table's arrays, which is quicker than an iterator. data
+ * and data_size are what hashtable_iterator_get_data and
+ * hashtable_iterator_get_data_size would return. If visit returns nonzero
+ * the walk stops and hashtable_foreach returns that value, otherwise it
+ * returns 0. visit may change the data in place but mustn't insert or
+ * remove elements. Like an iterator, it finishes a resize in progress.
+ *
+ * hashtable_clear:
+ * Removes every element but keeps the table's arrays at their current
+ * size, so refilling the table doesn't have to grow it again. Pooled
+ * memory goes back to the pool for reuse. On a concurrent table the
+ * elements are freed once no reader can be looking at them. Returns <0 for
+ * mapped and frozen tables.
  *
  * hashtable_free:
  * Frees all memory associated with the hashtable. Remember to use this.
  * **************************************************************************/
 
+/* Keys of up to HASHNODE_INLINE_KEY bytes and copied data of up to
+ * HASHNODE_INLINE_DATA bytes are stored in the node itself rather than in a
+ * separate allocation. */
+#define HASHNODE_INLINE_KEY 8
+#define HASHNODE_INLINE_DATA 16
+
 struct hashnode {
-  void *key;
+  union {
+    void *ptr;
+    uint8_t bytes[HASHNODE_INLINE_KEY];
+  } key;
   size_t key_size;
-  void *data;
+  union {
+    void *ptr;
+    uint8_t bytes[HASHNODE_INLINE_DATA];
+  } data;
   size_t data_size;
+  uint64_t hash; /* full hash of the key, checked before the key itself */
   struct hashnode *next;
 };
 
+#define HASHTABLE_CHAINED 0
+#define HASHTABLE_OPEN (1<<0)
+#define HASHTABLE_POOL (1<<1)
+#define HASHTABLE_CONCURRENT (1<<2)
+#define HASHTABLE_MAPPED (1<<3)
+#define HASHTABLE_FROZEN (1<<4)
+
+struct hashpool;
+struct hashsync;
+struct snapshot_slot;
+struct hashfrozen;
+
 typedef struct _hashtable {
   struct hashnode **nodearray;
   uint64_t (*hashfunc)(void *, size_t);
   size_t size;
+  int flags;
+  size_t count; /* number of entries */
+  uint8_t *ctrl; /* HASHTABLE_OPEN: metadata byte per slot */
+  struct hashnode *slots; /* HASHTABLE_OPEN: the entries themselves */
+  size_t deleted; /* HASHTABLE_OPEN: slots left behind by removals */
+  double max_load;
+  size_t grow_at; /* size*max_load */
+  /* While resizing, the previous array and the next position to move. */
+  struct hashnode **old_nodearray;
+  uint8_t *old_ctrl;
+  struct hashnode *old_slots;
+  size_t old_size;
+  size_t rehash_pos;
+  struct hashpool *pool; /* HASHTABLE_POOL: where entries are allocated */
+  size_t allocations; /* malloc calls made for entries */
+  struct hashsync *sync; /* HASHTABLE_CONCURRENT: locks and retired nodes */
+  /* HASHTABLE_MAPPED: the mapped file and its array of entries. ctrl and
+   * size describe the slots as for HASHTABLE_OPEN. */
+  uint8_t *map;
+  size_t map_size;
+  struct snapshot_slot *map_slots;
+  /* HASHTABLE_FROZEN: the seeds and remapped slots. slots holds the count
+   * entries, which is also the size. */
+  struct hashfrozen *frozen;
 } hashtable;
 
+#define HASHTABLE_STATS_LENGTHS 8
+
+struct hashtable_stats {
+  size_t count;
+  size_t buckets;
+  double load;
+  size_t deleted;
+  size_t bytes;
+  size_t lengths[HASHTABLE_STATS_LENGTHS];
+  size_t max_length;
+};
+
 typedef struct _hashtable_iterator {
   hashtable *iterating_table;
   size_t table_row;
@@ -63,19 +299,262 @@ typedef struct _hashtable_iterator {
 } hashtable_iterator;
 
 hashtable *hashtable_create(size_t size, uint64_t (*hashfunc)(void *, size_t));
+hashtable *hashtable_create_flags(size_t size, uint64_t (*hashfunc)(void *, size_t), int flags);
 int hashtable_insert(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size);
 int hashtable_insertref(hashtable *hashtbl, void *key, size_t key_size, void *data);
+void *hashtable_emplace(hashtable *hashtbl, void *key, size_t key_size, size_t data_size, int *inserted);
+void *hashtable_get_or_insert(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size);
 int hashtable_remove(hashtable *hashtbl, void *key, size_t key_size);
 void *hashtable_get(hashtable *hashtbl, void *key, size_t key_size);
+size_t hashtable_get_many(hashtable *hashtbl, void *keys, size_t key_size, void **out, size_t n);
+int hashtable_get_copy(hashtable *hashtbl, void *key, size_t key_size, void *out, size_t out_size);
+int hashtable_read_begin(hashtable *hashtbl);
+void hashtable_read_end(hashtable *hashtbl, int token);
+uint64_t hashtable_hash(hashtable *hashtbl, void *key, size_t key_size);
+void *hashtable_get_prehashed(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash);
+int hashtable_insert_prehashed(hashtable *hashtbl, void *key, size_t key_size, void *data, size_t data_size, uint64_t hash);
+int hashtable_remove_prehashed(hashtable *hashtbl, void *key, size_t key_size, uint64_t hash);
+void hashtable_stats(hashtable *hashtbl, struct hashtable_stats *stats);
+int hashtable_set_max_load(hashtable *hashtbl, double max_load);
+int hashtable_reserve(hashtable *hashtbl, size_t count);
+int hashtable_clear(hashtable *hashtbl);
 void hashtable_free(hashtable *hashtbl);
+int hashtable_snapshot(hashtable *hashtbl, const char *path);
+hashtable *hashtable_map(const char *path, uint64_t (*hashfunc)(void *, size_t), int validate);
+hashtable *hashtable_freeze(hashtable *hashtbl);
 hashtable_iterator *hashtable_iterator_create(hashtable *hashtable);
+void hashtable_iterator_init(hashtable *hashtable, hashtable_iterator *iterator);
 void hashtable_iterator_next(hashtable_iterator *iterator);
 void *hashtable_iterator_get_key(hashtable_iterator *iterator);
 size_t hashtable_iterator_get_key_size(hashtable_iterator *iterator);
 void *hashtable_iterator_get_data(hashtable_iterator *iterator);
 size_t hashtable_iterator_get_data_size(hashtable_iterator *iterator);
 void hashtable_iterator_free(hashtable_iterator *iterator);
+int hashtable_foreach(hashtable *hashtbl, int (*visit)(void *key, size_t key_size, void *data, size_t data_size, void *ctx), void *ctx);
 
 uint64_t fnv1a64(void *buf, size_t len);
+uint64_t mulmix64(void *buf, size_t len);
+uint64_t inthash64(void *buf, size_t len);
+
+/*****************************************************************************
+ * DECLARE_HASHTABLE(name, key_t, val_t, hashfn, eqfn) generates a table
+ * type for keys and values of fixed types, for when the generic table's
+ * function pointer hash, key_size checks and memcmp cost more than the
+ * lookup itself. Keys and values are stored by value in one array next to
+ * a control byte per slot, and hashfn and eqfn are called directly so the
+ * compiler can inline them. hashfn takes a key_t and returns a uint64_t,
+ * and eqfn takes two key_t and returns nonzero if they are equal. Either
+ * may be a macro. For integer and char keys hashtable_mix64 and
+ * hashtable_eq_scalar will do. Use it once at file scope, which defines
+ * the type name and these static inline functions:
+ *
+ * name_init(name *t, size_t size):
+ * Sets up an empty table that holds size elements before growing. Returns
+ * <0 on error.
+ *
+ * name_insert(name *t, key_t key, val_t value):
+ * Inserts or overwrites the value for key. Returns <0 on error.
+ *
+ * name_get(name *t, key_t key):
+ * Returns a pointer to the value for key, or NULL. The pointer is good
+ * until the next insert or remove.
+ *
+ * name_remove(name *t, key_t key):
+ * Removes key. Returns <0 if it wasn't there.
+ *
+ * name_foreach(name *t, visit, ctx):
+ * Calls visit(key_t *key, val_t *value, void *ctx) for every element, and
+ * stops and returns what it returns if that is nonzero.
+ *
+ * name_clear(name *t), name_free(name *t):
+ * Remove every element, keeping the arrays, or free the arrays.
+ *
+ * Tables grow once 3/4 full. Probing is linear from the slot picked by the
+ * hash, and the control byte holds seven bits of the hash so eqfn is
+ * rarely called for the wrong key. The generic hashtable is still the one
+ * for keys of varying size.
+ * **************************************************************************/
+
+#define HASHTABLE_DECL_EMPTY ((uint8_t)0x80)
+#define HASHTABLE_DECL_DELETED ((uint8_t)0xfe)
+#define HASHTABLE_DECL_MIN 8
+#define HASHTABLE_DECL_NONE ((size_t)-1)
+
+/* The finalizer of inthash64, for keys that convert to an integer. */
+static inline uint64_t hashtable_mix64(uint64_t h) {
+  h ^= h>>33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h>>33;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h>>33;
+  return h;
+}
+
+#define hashtable_eq_scalar(a, b) ((a)==(b))
+
+#define DECLARE_HASHTABLE(name, key_t, val_t, hashfn, eqfn) \
+struct name##_slot { \
+  key_t key; \
+  val_t value; \
+}; \
+\
+typedef struct _##name { \
+  size_t size; \
+  size_t count; \
+  size_t deleted; \
+  uint8_t *ctrl; \
+  struct name##_slot *slots; \
+} name; \
+\
+static inline size_t name##_find(name *t, key_t key, uint64_t hash) { \
+  size_t mask = t->size-1; \
+  size_t pos = (size_t)(hash>>7)&mask; \
+  uint8_t tag = hash&0x7f; \
+  uint8_t c; \
+\
+  while(1) { \
+    c = t->ctrl[pos]; \
+    if(c==tag && eqfn(t->slots[pos].key,key)) { \
+      return pos; \
+    } \
+    if(c==HASHTABLE_DECL_EMPTY) { \
+      return HASHTABLE_DECL_NONE; \
+    } \
+    pos = (pos+1)&mask; \
+  } \
+} \
+\
+static inline int name##_rehash(name *t, size_t size) { \
+  uint8_t *ctrl = (uint8_t *)malloc(size); \
+  struct name##_slot *slots = (struct name##_slot *)malloc(size*sizeof(struct name##_slot)); \
+  size_t mask = size-1; \
+  size_t i, pos; \
+\
+  if(!ctrl || !slots) { \
+    free(ctrl); \
+    free(slots); \
+    return -1; \
+  } \
+  memset(ctrl,HASHTABLE_DECL_EMPTY,size); \
+\
+  for(i=0;i<t->size;i++) { \
+    if(t->ctrl[i]&0x80) { \
+      continue; \
+    } \
+    pos = (size_t)(hashfn(t->slots[i].key)>>7)&mask; \
+    while(ctrl[pos]!=HASHTABLE_DECL_EMPTY) { \
+      pos = (pos+1)&mask; \
+    } \
+    ctrl[pos] = t->ctrl[i]; \
+    slots[pos] = t->slots[i]; \
+  } \
+\
+  free(t->ctrl); \
+  free(t->slots); \
+  t->ctrl = ctrl; \
+  t->slots = slots; \
+  t->size = size; \
+  t->deleted = 0; \
+  return 0; \
+} \
+\
+static inline int name##_init(name *t, size_t size) { \
+  size_t capacity; \
+\
+  for(capacity=HASHTABLE_DECL_MIN;capacity/4*3<size;capacity*=2); \
+  t->size = 0; \
+  t->count = 0; \
+  t->deleted = 0; \
+  t->ctrl = NULL; \
+  t->slots = NULL; \
+  return name##_rehash(t,capacity); \
+} \
+\
+static inline val_t *name##_get(name *t, key_t key) { \
+  size_t pos = name##_find(t,key,hashfn(key)); \
+\
+  return pos==HASHTABLE_DECL_NONE ? NULL : &t->slots[pos].value; \
+} \
+\
+static inline int name##_insert(name *t, key_t key, val_t value) { \
+  uint64_t hash = hashfn(key); \
+  size_t pos = name##_find(t,key,hash); \
+  size_t mask; \
+\
+  if(pos!=HASHTABLE_DECL_NONE) { \
+    t->slots[pos].value = value; \
+    return 0; \
+  } \
+\
+  /* Grow, or just sweep out deleted slots if they fill most of it. */ \
+  if(t->count+t->deleted+1 > t->size/4*3) { \
+    if(name##_rehash(t,t->count+1 > t->size/8*3 ? t->size*2 : t->size)<0) { \
+      return -1; \
+    } \
+  } \
+\
+  mask = t->size-1; \
+  pos = (size_t)(hash>>7)&mask; \
+  while(!(t->ctrl[pos]&0x80)) { \
+    pos = (pos+1)&mask; \
+  } \
+  if(t->ctrl[pos]==HASHTABLE_DECL_DELETED) { \
+    t->deleted--; \
+  } \
+  t->ctrl[pos] = hash&0x7f; \
+  t->slots[pos].key = key; \
+  t->slots[pos].value = value; \
+  t->count++; \
+  return 0; \
+} \
+\
+/* No probe can pass an empty slot, so if the next slot is empty this one \
+ * can be emptied too rather than marked deleted. */ \
+static inline int name##_remove(name *t, key_t key) { \
+  size_t pos = name##_find(t,key,hashfn(key)); \
+\
+  if(pos==HASHTABLE_DECL_NONE) { \
+    return -1; \
+  } \
+  if(t->ctrl[(pos+1)&(t->size-1)]==HASHTABLE_DECL_EMPTY) { \
+    t->ctrl[pos] = HASHTABLE_DECL_EMPTY; \
+  } \
+  else { \
+    t->ctrl[pos] = HASHTABLE_DECL_DELETED; \
+    t->deleted++; \
+  } \
+  t->count--; \
+  return 0; \
+} \
+\
+static inline int name##_foreach(name *t, int (*visit)(key_t *key, val_t *value, void *ctx), void *ctx) { \
+  size_t i; \
+  int ret; \
+\
+  for(i=0;i<t->size;i++) { \
+    if(!(t->ctrl[i]&0x80)) { \
+      ret = visit(&t->slots[i].key,&t->slots[i].value,ctx); \
+      if(ret) { \
+        return ret; \
+      } \
+    } \
+  } \
+  return 0; \
+} \
+\
+static inline void name##_clear(name *t) { \
+  memset(t->ctrl,HASHTABLE_DECL_EMPTY,t->size); \
+  t->count = 0; \
+  t->deleted = 0; \
+} \
+\
+static inline void name##_free(name *t) { \
+  free(t->ctrl); \
+  free(t->slots); \
+  t->ctrl = NULL; \
+  t->slots = NULL; \
+  t->size = 0; \
+  t->count = 0; \
+}
 
 #endif /*!_HASHTABLE_H*/
@@ -2,15 +2,69 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+
+/* The concurrent stress test: each writer owns every STRESS_WRITERS'th key
+ * and keeps rewriting and removing them while readers check that whatever
+ * they find is a whole value for the key they asked for. */
+#define STRESS_WRITERS 4
+#define STRESS_READERS 4
+#define STRESS_KEYS 4096
+#define STRESS_ROUNDS 40
+
+struct stress_value {
+  int key;
+  int version;
+  int check;
+};
+
+struct stress_thread {
+  hashtable *hashtbl;
+  int id;
+  int *stop;
+  long reads;
+  long errors;
+};
+
+DECLARE_HASHTABLE(inttable, int, int, hashtable_mix64, hashtable_eq_scalar)
+
+void *stress_writer(void *arg);
+void *stress_reader(void *arg);
+int stress_check(struct stress_value *value, int key);
+int sum_visit(void *key, size_t key_size, void *data, size_t data_size, void *ctx);
+int inttable_visit(int *key, int *value, void *ctx);
 
 int main(int argc, char *argv[]) {
   char *test = "Hello";
   hashtable *hashtbl;
   int i;
+  int errors;
+  int f;
+  uint64_t hash;
   char letter;
   int *ip;
   hashtable_iterator *iterator;
   char *key;
+  pthread_t threads[STRESS_WRITERS+STRESS_READERS];
+  struct stress_thread stress[STRESS_WRITERS+STRESS_READERS];
+  struct stress_value value;
+  struct hashtable_stats stats;
+  int many_keys[2000];
+  void *many_out[2000];
+  int stop;
+  long reads;
+  hashtable *mapped;
+  hashtable *frozen;
+  FILE *snapfile;
+  hashtable_iterator stack_iterator;
+  inttable typed;
+  long *counter;
+  int inserted;
+  int added;
+  int k;
+  char big[32];
+  long sum;
+  size_t size;
 
   hashtbl = hashtable_create(8,NULL);
   if(!hashtbl) {
@@ -94,11 +148,640 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  printf("Buckets after growing: %zu for %zu entries\n",hashtbl->size,hashtbl->count);
+  hashtable_stats(hashtbl,&stats);
+  reads=0;
+  for(i=0;i<HASHTABLE_STATS_LENGTHS;i++) {
+    reads+=stats.lengths[i];
+  }
+  printf("Stats: %zu entries, load %.2f, %ld buckets in histogram (should be %zu), %zu bytes\n",
+      stats.count,stats.load,reads,stats.buckets,stats.bytes);
+
   hashtable_free(hashtbl);
-  
+
+  printf("Reserved table.\n");
+  hashtbl = hashtable_create(8,NULL);
+  if(!hashtbl || hashtable_set_max_load(hashtbl,4.0)<0 || hashtable_reserve(hashtbl,100000)<0) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+  printf("Buckets after reserve: %zu (should be 25001)\n",hashtbl->size);
+  for(i=0;i<100000;i++) {
+    hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+  }
+  printf("Buckets after inserting: %zu (should be 25001)\n",hashtbl->size);
+  hashtable_free(hashtbl);
+
+  printf("Open addressing.\n");
+  hashtbl = hashtable_create_flags(8,NULL,HASHTABLE_OPEN);
+  if(!hashtbl) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+
+  for(i=0;i<100000;i++) {
+    if(hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i))<0) {
+      fprintf(stderr, "Insertion error at %d\n",i);
+    }
+  }
+
+  for(i=0;i<100000;i+=2) {
+    if(hashtable_remove(hashtbl,&i,sizeof(i))<0) {
+      fprintf(stderr, "Removal error at %d\n",i);
+    }
+  }
+
+  errors=0;
+  for(i=0;i<100000;i++) {
+    ip = (int*)hashtable_get(hashtbl,&i,sizeof(i));
+    if((i%2==0 && ip!=NULL) || (i%2==1 && (ip==NULL || *ip!=i))) {
+      errors++;
+    }
+  }
+  printf("Entries: %zu (should be 50000), lookup errors: %d\n",hashtbl->count,errors);
+  if(hashtable_set_max_load(hashtbl,0.9)==0) {
+    printf("Accepted a max load above 7/8!!!!\n");
+  }
+
+  for(i=0;i<100000;i+=2) {
+    if(hashtable_insertref(hashtbl,&i,sizeof(i),test)<0) {
+      fprintf(stderr, "Insertion error at %d\n",i);
+    }
+  }
+  printf("Entries: %zu (should be 100000), capacity %zu\n",hashtbl->count,hashtbl->size);
+  i=40000;
+  printf("Reference for 40000: %s (should be %s)\n",(char*)hashtable_get(hashtbl,&i,sizeof(i)),test);
+
+  iterator = hashtable_iterator_create(hashtbl);
+  hashtable_iterator_next(iterator);
+  errors=0;
+  while(hashtable_iterator_get_key(iterator)!=NULL) {
+    errors++;
+    hashtable_iterator_next(iterator);
+  }
+  hashtable_iterator_free(iterator);
+  printf("Iterated over %d entries\n",errors);
+
+  hashtable_free(hashtbl);
+
+  printf("Inline and heap keys.\n");
+  hashtbl = hashtable_create(8,NULL);
+  if(!hashtbl) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+  i=6;
+  hashtable_insert(hashtbl,"short",6,&i,sizeof(i));
+  i=7;
+  hashtable_insert(hashtbl,"a much longer key",18,&i,sizeof(i));
+  hashtable_insertref(hashtbl,"another long key",17,test);
+  ip = (int*)hashtable_get(hashtbl,"short",6);
+  hashtable_insert(hashtbl,"a much longer key",18,ip,sizeof(int));
+  ip = (int*)hashtable_get(hashtbl,"a much longer key",18);
+  printf("Long key copied from short key: %d (should be 6)\n",*ip);
+  printf("Reference for long key: %s (should be %s)\n",(char*)hashtable_get(hashtbl,"another long key",17),test);
+  printf("Mallocs for three entries: %zu (should be 5)\n",hashtbl->allocations);
+  hash = hashtable_hash(hashtbl,"short",6);
+  ip = (int*)hashtable_get_prehashed(hashtbl,"short",6,hash);
+  printf("Prehashed lookup of short key: %d (should be 6)\n",*ip);
+  i=8;
+  hashtable_insert_prehashed(hashtbl,"short",6,&i,sizeof(i),hash);
+  ip = (int*)hashtable_get(hashtbl,"short",6);
+  printf("After prehashed insert: %d (should be 8)\n",*ip);
+  if(hashtable_remove_prehashed(hashtbl,"short",6,hash+1)==0) {
+    printf("Removed with the wrong hash!!!!\n");
+  }
+  if(hashtable_remove_prehashed(hashtbl,"short",6,hash)<0 || hashtable_get(hashtbl,"short",6)!=NULL) {
+    printf("Prehashed removal failed!!!!\n");
+  }
+  hashtable_free(hashtbl);
+
+  printf("Pooled allocation.\n");
+  hashtbl = hashtable_create_flags(8,NULL,HASHTABLE_POOL);
+  if(!hashtbl) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+
+  for(i=0;i<100000;i++) {
+    if(hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i))<0) {
+      fprintf(stderr, "Insertion error at %d\n",i);
+    }
+  }
+  for(i=0;i<100000;i+=2) {
+    hashtable_remove(hashtbl,&i,sizeof(i));
+  }
+  for(i=0;i<100000;i+=2) {
+    if(hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i))<0) {
+      fprintf(stderr, "Insertion error at %d\n",i);
+    }
+  }
+
+  errors=0;
+  for(i=0;i<100000;i++) {
+    ip = (int*)hashtable_get(hashtbl,&i,sizeof(i));
+    if(ip==NULL || *ip!=i) {
+      errors++;
+    }
+  }
+  printf("Lookup errors: %d, mallocs for 100000 entries: %zu (should be small)\n",errors,hashtbl->allocations);
+  hashtable_free(hashtbl);
+
+  printf("Built in hashes.\n");
+  for(f=0;f<2;f++) {
+    hashtbl = hashtable_create_flags(8,f ? inthash64 : mulmix64,f ? HASHTABLE_OPEN : HASHTABLE_CHAINED);
+    if(!hashtbl) {
+      fprintf(stderr, "Table allocation error\n");
+      exit(1);
+    }
+    for(i=0;i<100000;i++) {
+      hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+    }
+    errors=0;
+    for(i=0;i<100000;i++) {
+      ip = (int*)hashtable_get(hashtbl,&i,sizeof(i));
+      if(ip==NULL || *ip!=i) {
+        errors++;
+      }
+    }
+    printf("%s lookup errors: %d\n",f ? "inthash64" : "mulmix64",errors);
+
+    for(i=0;i<2000;i++) {
+      many_keys[i]=99000+i;
+    }
+    errors = hashtable_get_many(hashtbl,many_keys,sizeof(int),many_out,2000)==1000 ? 0 : 1;
+    for(i=0;i<2000;i++) {
+      if(many_keys[i]<100000 ? (many_out[i]==NULL || *(int*)many_out[i]!=many_keys[i]) : many_out[i]!=NULL) {
+        errors++;
+      }
+    }
+    printf("get_many errors: %d\n",errors);
+    hashtable_free(hashtbl);
+  }
+
+  printf("Foreach and clear.\n");
+  for(f=0;f<4;f++) {
+    hashtbl = hashtable_create_flags(8,NULL,f==3 ? HASHTABLE_CONCURRENT : f);
+    if(!hashtbl) {
+      fprintf(stderr, "Table allocation error\n");
+      exit(1);
+    }
+    for(i=1;i<=1000;i++) {
+      hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+    }
+    sum=0;
+    errors = hashtable_foreach(hashtbl,sum_visit,&sum)==0 ? 0 : 1;
+    if(sum!=500500) {
+      errors++;
+    }
+    /* Stop once the sum passes 1000. */
+    sum=-1000;
+    if(hashtable_foreach(hashtbl,sum_visit,&sum)!=1 || sum<=0 || sum>2000) {
+      errors++;
+    }
+    hashtable_iterator_init(hashtbl,&stack_iterator);
+    for(hashtable_iterator_next(&stack_iterator);hashtable_iterator_get_key(&stack_iterator)!=NULL;hashtable_iterator_next(&stack_iterator)) {
+      errors--;
+    }
+    errors+=1000;
+
+    size=hashtbl->size;
+    if(hashtable_clear(hashtbl)<0 || hashtbl->count!=0 || hashtbl->size!=size) {
+      errors++;
+    }
+    for(i=1;i<=1000;i++) {
+      if(hashtable_get(hashtbl,&i,sizeof(i))!=NULL) {
+        errors++;
+      }
+    }
+    for(i=1;i<=10;i++) {
+      hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+    }
+    sum=0;
+    hashtable_foreach(hashtbl,sum_visit,&sum);
+    printf("Flags %d: errors %d, sum after clear %ld (should be 55), size kept %zu\n",f==3 ? HASHTABLE_CONCURRENT : f,errors,sum,hashtbl->size);
+    hashtable_free(hashtbl);
+  }
+
+  printf("Emplace.\n");
+  for(f=0;f<3;f++) {
+    hashtbl = hashtable_create_flags(8,NULL,f);
+    if(!hashtbl) {
+      fprintf(stderr, "Table allocation error\n");
+      exit(1);
+    }
+    added=0;
+    errors=0;
+    for(i=0;i<30000;i++) {
+      k = i%1000;
+      counter = (long *)hashtable_emplace(hashtbl,&k,sizeof(k),sizeof(long),&inserted);
+      if(!counter) {
+        errors++;
+        continue;
+      }
+      (*counter)++;
+      added+=inserted;
+    }
+    for(i=0;i<1000;i++) {
+      counter = (long *)hashtable_get(hashtbl,&i,sizeof(i));
+      if(!counter || *counter!=30) {
+        errors++;
+      }
+    }
+
+    /* Existing data stays put, missing keys get the data given. */
+    i=5;
+    ip = (int *)hashtable_get_or_insert(hashtbl,&i,sizeof(i),&f,sizeof(f));
+    if(!ip || *(long *)ip!=30) {
+      errors++;
+    }
+    i=5000;
+    ip = (int *)hashtable_get_or_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+    if(!ip || *ip!=5000 || hashtable_get(hashtbl,&i,sizeof(i))!=ip) {
+      errors++;
+    }
+
+    /* Growing keeps the old bytes, a reference becomes a copy. */
+    i=7;
+    counter = (long *)hashtable_emplace(hashtbl,&i,sizeof(i),sizeof(big),&inserted);
+    if(!counter || inserted || counter[0]!=30 || counter[1]!=0 || counter[3]!=0) {
+      errors++;
+    }
+    hashtable_insertref(hashtbl,&i,sizeof(i),test);
+    counter = (long *)hashtable_emplace(hashtbl,&i,sizeof(i),sizeof(long),NULL);
+    if(!counter || (char *)counter==test || *counter!=0) {
+      errors++;
+    }
+
+    /* Overwriting with data of the same size reuses the block. */
+    k=8;
+    hashtable_insert(hashtbl,&k,sizeof(k),big,sizeof(big));
+    size=hashtbl->allocations;
+    for(i=0;i<100;i++) {
+      big[0]=i;
+      hashtable_insert(hashtbl,&k,sizeof(k),big,sizeof(big));
+    }
+    if(hashtbl->allocations!=size || ((char *)hashtable_get(hashtbl,&k,sizeof(k)))[0]!=99) {
+      errors++;
+    }
+    printf("Flags %d: %d keys added (should be 1000), errors %d\n",f,added,errors);
+    hashtable_free(hashtbl);
+  }
+  hashtbl = hashtable_create_flags(8,NULL,HASHTABLE_CONCURRENT);
+  if(!hashtbl) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+  if(hashtable_emplace(hashtbl,&k,sizeof(k),sizeof(long),NULL)!=NULL) {
+    printf("Emplaced into a concurrent table!!!!\n");
+  }
+  hashtable_free(hashtbl);
+
+  printf("Typed table.\n");
+  if(inttable_init(&typed,4)<0) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+  for(i=0;i<100000;i++) {
+    if(inttable_insert(&typed,i,i)<0) {
+      fprintf(stderr, "Insertion error at %d\n",i);
+    }
+  }
+  for(i=0;i<100000;i+=2) {
+    if(inttable_remove(&typed,i)<0) {
+      fprintf(stderr, "Removal error at %d\n",i);
+    }
+  }
+  for(i=0;i<100000;i+=4) {
+    inttable_insert(&typed,i,-i);
+  }
+  errors=0;
+  for(i=0;i<100000;i++) {
+    ip = inttable_get(&typed,i);
+    if(i%4==0 ? (ip==NULL || *ip!=-i) : i%2==0 ? ip!=NULL : (ip==NULL || *ip!=i)) {
+      errors++;
+    }
+  }
+  if(inttable_remove(&typed,2)==0) {
+    errors++;
+  }
+  sum=0;
+  inttable_foreach(&typed,inttable_visit,&sum);
+  printf("Entries: %zu (should be 75000), lookup errors: %d, sum %ld (should be 1250050000)\n",typed.count,errors,sum);
+  size=typed.size;
+  inttable_clear(&typed);
+  inttable_insert(&typed,7,8);
+  printf("After clear: %zu entries, size kept: %s, 7 = %d (should be 8)\n",typed.count,typed.size==size ? "yes" : "no",*inttable_get(&typed,7));
+  inttable_free(&typed);
+
+  printf("Snapshot.\n");
+  hashtbl = hashtable_create_flags(8,mulmix64,HASHTABLE_OPEN);
+  if(!hashtbl) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+  for(i=0;i<10000;i++) {
+    hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+  }
+  hashtable_insert(hashtbl,"a long key for the snapshot",27,test,strlen(test)+1);
+  hashtable_insert(hashtbl,"empty",5,NULL,0);
+  if(hashtable_snapshot(hashtbl,"hashtest.snap")<0) {
+    fprintf(stderr, "Unable to write snapshot\n");
+    exit(1);
+  }
+  hashtable_free(hashtbl);
+
+  mapped = hashtable_map("hashtest.snap",mulmix64,1);
+  if(!mapped) {
+    fprintf(stderr, "Unable to map snapshot\n");
+    exit(1);
+  }
+  errors=0;
+  for(i=0;i<10000;i++) {
+    ip = (int*)hashtable_get(mapped,&i,sizeof(i));
+    if(ip==NULL || *ip!=i) {
+      errors++;
+    }
+  }
+  i=10000;
+  if(hashtable_get(mapped,&i,sizeof(i))!=NULL || hashtable_get(mapped,"empty",5)==NULL) {
+    errors++;
+  }
+  printf("Mapped lookup errors: %d, long key: %s (should be %s)\n",errors,(char*)hashtable_get(mapped,"a long key for the snapshot",27),test);
+  errors=0;
+  iterator = hashtable_iterator_create(mapped);
+  hashtable_iterator_next(iterator);
+  while(hashtable_iterator_get_key(iterator)!=NULL) {
+    errors++;
+    hashtable_iterator_next(iterator);
+  }
+  hashtable_iterator_free(iterator);
+  printf("Iterated over %d mapped entries (should be 10002)\n",errors);
+  if(hashtable_insert(mapped,&i,sizeof(i),&i,sizeof(i))>=0) {
+    printf("Inserted into a mapped table!!!!\n");
+  }
+  /* Rewriting the file under a mapping must leave the mapping readable */
+  if(hashtable_snapshot(mapped,"hashtest.snap")<0) {
+    printf("Unable to snapshot a mapped table to its own file!!!!\n");
+  }
+  i=5000;
+  ip = (int *)hashtable_get(mapped,&i,sizeof(i));
+  if(!ip || *ip!=i) {
+    printf("Mapping broken by rewriting its file!!!!\n");
+  }
+  hashtable_free(mapped);
+
+  if(hashtable_map("hashtest.snap",NULL,0)!=NULL) {
+    printf("Mapped a snapshot with the wrong hash!!!!\n");
+  }
+  /* Flip a byte of the last value so only the full validation notices. */
+  snapfile = fopen("hashtest.snap","r+b");
+  if(snapfile) {
+    fseek(snapfile,-8,SEEK_END);
+    fputc(0xff,snapfile);
+    fclose(snapfile);
+  }
+  mapped = hashtable_map("hashtest.snap",mulmix64,0);
+  printf("Corrupted snapshot: header %s, validation %s (should be accepted, rejected)\n",
+         mapped ? "accepted" : "rejected",hashtable_map("hashtest.snap",mulmix64,1) ? "accepted" : "rejected");
+  if(mapped) {
+    hashtable_free(mapped);
+  }
+  remove("hashtest.snap");
+
+  hashtbl = hashtable_create(8,NULL);
+  hashtable_insertref(hashtbl,"ref",3,test);
+  if(hashtable_snapshot(hashtbl,"hashtest.snap")>=0) {
+    printf("Wrote a snapshot of a reference!!!!\n");
+  }
+  hashtable_free(hashtbl);
+
+  printf("Frozen table.\n");
+  for(f=0;f<2;f++) {
+    hashtbl = hashtable_create_flags(8,NULL,f);
+    if(!hashtbl) {
+      fprintf(stderr, "Table allocation error\n");
+      exit(1);
+    }
+    for(i=0;i<100000;i++) {
+      hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+    }
+    hashtable_insert(hashtbl,"a long key to freeze",20,test,strlen(test)+1);
+    hashtable_insertref(hashtbl,"ref",3,test);
+    hashtable_insert(hashtbl,"empty",5,NULL,0);
+    frozen = hashtable_freeze(hashtbl);
+    hashtable_free(hashtbl);
+    if(!frozen) {
+      fprintf(stderr, "Unable to freeze table\n");
+      exit(1);
+    }
+
+    errors=0;
+    for(i=0;i<100000;i++) {
+      ip = (int*)hashtable_get(frozen,&i,sizeof(i));
+      if(ip==NULL || *ip!=i) {
+        errors++;
+      }
+    }
+    for(i=0;i<2000;i++) {
+      many_keys[i]=99000+i;
+    }
+    if(hashtable_get_many(frozen,many_keys,sizeof(int),many_out,2000)!=1000) {
+      errors++;
+    }
+    for(i=0;i<2000;i++) {
+      if(many_keys[i]<100000 ? (many_out[i]==NULL || *(int*)many_out[i]!=many_keys[i]) : many_out[i]!=NULL) {
+        errors++;
+      }
+    }
+    if(hashtable_get(frozen,"ref",3)!=test || hashtable_get(frozen,"empty",5)==NULL || hashtable_get(frozen,"missing",7)!=NULL) {
+      errors++;
+    }
+    hashtable_iterator_init(frozen,&stack_iterator);
+    for(hashtable_iterator_next(&stack_iterator);hashtable_iterator_get_key(&stack_iterator)!=NULL;hashtable_iterator_next(&stack_iterator)) {
+      errors--;
+    }
+    errors+=100003;
+    hashtable_stats(frozen,&stats);
+    if(stats.count!=100003 || stats.lengths[0]!=stats.count || stats.buckets<stats.count) {
+      errors++;
+    }
+    if(hashtable_insert(frozen,&i,sizeof(i),&i,sizeof(i))>=0 || hashtable_remove(frozen,&i,sizeof(i))>=0 || hashtable_clear(frozen)>=0) {
+      printf("Changed a frozen table!!!!\n");
+    }
+    printf("Flags %d: lookup errors %d, long key: %s (should be %s), load %.2f\n",f,errors,(char*)hashtable_get(frozen,"a long key to freeze",20),test,stats.load);
+    hashtable_free(frozen);
+  }
+
+  /* Two keys with the same hash can't be told apart by any seed. */
+  hashtbl = hashtable_create(8,NULL);
+  hashtable_insert_prehashed(hashtbl,"x",1,&i,sizeof(i),42);
+  hashtable_insert_prehashed(hashtbl,"y",1,&i,sizeof(i),42);
+  if(hashtable_freeze(hashtbl)!=NULL) {
+    printf("Froze two keys with one hash!!!!\n");
+  }
+  hashtable_clear(hashtbl);
+  frozen = hashtable_freeze(hashtbl);
+  if(!frozen || hashtable_get(frozen,"x",1)!=NULL) {
+    printf("Empty frozen table failed!!!!\n");
+  }
+  if(frozen) {
+    hashtable_free(frozen);
+  }
+  hashtable_free(hashtbl);
+
+  printf("Concurrent stress test.\n");
+  hashtbl = hashtable_create_flags(16,NULL,HASHTABLE_CONCURRENT);
+  if(!hashtbl) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+  if(hashtable_create_flags(16,NULL,HASHTABLE_CONCURRENT|HASHTABLE_OPEN)!=NULL) {
+    printf("Created a concurrent open table!!!!\n");
+  }
+
+  stop=0;
+  for(i=0;i<STRESS_WRITERS+STRESS_READERS;i++) {
+    stress[i].hashtbl=hashtbl;
+    stress[i].id=i;
+    stress[i].stop=&stop;
+    stress[i].reads=0;
+    stress[i].errors=0;
+    if(pthread_create(&threads[i],NULL,i<STRESS_WRITERS ? stress_writer : stress_reader,&stress[i])!=0) {
+      fprintf(stderr, "Unable to start thread %d\n",i);
+      exit(1);
+    }
+  }
+  for(i=0;i<STRESS_WRITERS;i++) {
+    pthread_join(threads[i],NULL);
+  }
+  __atomic_store_n(&stop,1,__ATOMIC_RELEASE);
+  errors=0;
+  reads=0;
+  for(i=0;i<STRESS_WRITERS+STRESS_READERS;i++) {
+    if(i>=STRESS_WRITERS) {
+      pthread_join(threads[i],NULL);
+    }
+    errors+=stress[i].errors;
+    reads+=stress[i].reads;
+  }
+
+  for(i=0;i<STRESS_KEYS;i++) {
+    if(hashtable_get_copy(hashtbl,&i,sizeof(i),&value,sizeof(value))<0 || stress_check(&value,i)<0 || value.version!=STRESS_ROUNDS) {
+      errors++;
+    }
+  }
+  printf("Entries: %zu (should be %d), errors: %d over %ld concurrent reads\n",hashtbl->count,STRESS_KEYS,errors,reads);
+  hashtable_free(hashtbl);
+
+  printf("Writing inside a read section.\n");
+  hashtbl = hashtable_create_flags(16,NULL,HASHTABLE_CONCURRENT);
+  if(!hashtbl) {
+    fprintf(stderr, "Table allocation error\n");
+    exit(1);
+  }
+  i=0;
+  hashtable_insert(hashtbl,&i,sizeof(i),&i,sizeof(i));
+  f = hashtable_read_begin(hashtbl);
+  ip = (int *)hashtable_get(hashtbl,&i,sizeof(i));
+  // Grows the table and replaces key 0 more than a retire batch's worth
+  for(k=1;k<1000;k++) {
+    hashtable_insert(hashtbl,&k,sizeof(k),&k,sizeof(k));
+  }
+  for(k=1;k<=300;k++) {
+    hashtable_insert(hashtbl,&i,sizeof(i),&k,sizeof(k));
+  }
+  if(!ip || *ip!=0) {
+    printf("Value read before the writes changed!!!!\n");
+  }
+  hashtable_read_end(hashtbl,f);
+  k=1000;
+  hashtable_insert(hashtbl,&k,sizeof(k),&k,sizeof(k));
+  ip = (int *)hashtable_get(hashtbl,&i,sizeof(i));
+  printf("Entries: %zu (should be 1001), key 0 holds %d (should be 300)\n",hashtbl->count,ip ? *ip : -1);
+  if(hashtbl->count!=1001 || !ip || *ip!=300) {
+    printf("Writes inside a read section went wrong!!!!\n");
+  }
+  hashtable_free(hashtbl);
+
   printf("size of uint8_t = %lu\n", sizeof(uint8_t));
   printf("length of \"%s\" = %lu\n",test,strlen(test));
   printf("Hash without null: %"PRIu64"\n",fnv1a64(test,strlen(test)));
   printf("Hash with null: %"PRIu64"\n",fnv1a64(test,strlen(test)+1));
+  printf("mulmix64 of \"%s\": %"PRIu64"\n",test,mulmix64(test,strlen(test)));
   exit(0);
 }
+
+void *stress_writer(void *arg) {
+  struct stress_thread *thread = (struct stress_thread *)arg;
+  struct stress_value value;
+  int round, key;
+
+  for(round=0;round<=STRESS_ROUNDS;round++) {
+    for(key=thread->id;key<STRESS_KEYS;key+=STRESS_WRITERS) {
+      value.key=key;
+      value.version=round;
+      value.check=key^round^0x5a5a5a5a;
+      if(hashtable_insert(thread->hashtbl,&key,sizeof(key),&value,sizeof(value))<0) {
+        thread->errors++;
+      }
+    }
+    if(round==STRESS_ROUNDS) {
+      break;
+    }
+    for(key=thread->id;key<STRESS_KEYS;key+=STRESS_WRITERS) {
+      if((key+round)%3==0 && hashtable_remove(thread->hashtbl,&key,sizeof(key))<0) {
+        thread->errors++;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+void *stress_reader(void *arg) {
+  struct stress_thread *thread = (struct stress_thread *)arg;
+  struct stress_value value;
+  struct stress_value *vp;
+  unsigned int seed = thread->id;
+  int key;
+  int token;
+
+  while(!__atomic_load_n(thread->stop,__ATOMIC_ACQUIRE)) {
+    key = rand_r(&seed)%STRESS_KEYS;
+    if(hashtable_get_copy(thread->hashtbl,&key,sizeof(key),&value,sizeof(value))==0 && stress_check(&value,key)<0) {
+      thread->errors++;
+    }
+
+    token = hashtable_read_begin(thread->hashtbl);
+    vp = (struct stress_value *)hashtable_get(thread->hashtbl,&key,sizeof(key));
+    if(vp && stress_check(vp,key)<0) {
+      thread->errors++;
+    }
+    hashtable_read_end(thread->hashtbl,token);
+    thread->reads+=2;
+  }
+
+  return NULL;
+}
+
+int stress_check(struct stress_value *value, int key) {
+  if(value->key!=key || value->check!=(key^value->version^0x5a5a5a5a)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Adds each int to the sum in ctx, stopping the walk when the sum first
+ * goes above zero. */
+int sum_visit(void *key, size_t key_size, void *data, size_t data_size, void *ctx) {
+  long *sum = (long *)ctx;
+
+  *sum += *(int *)data;
+  return *sum>0 && *sum-*(int *)data<0;
+}
+
+int inttable_visit(int *key, int *value, void *ctx) {
+  *(long *)ctx += *value;
+  return 0;
+}
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include "input.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Will set the following GPIO for controllers:
+ * pin 11 = gpio45 (pulldown) = ROTR
+ * pin 13 = gpio23 (pulldown) = ROTL
+ * pin 15 = gpio47 (pulldown) = LEFT
+ * pin 17 = gpio27 (pulldown) = RIGHT
+ * pin 19 = gpio22 (pulldown) = DOWN
+ */
+static const int gpios[INPUT_BUTTONS] = { 45, 23, 47, 27, 22 };
+static const char *fake_names[INPUT_BUTTONS] = { "rotr", "rotl", "left", "right", "down" };
+
+static void input_reset(input_dev *dev);
+static int write_sysfs(const char *path, const char *value);
+static int update_button(input_dev *dev, int button, char value);
+
+int input_open_gpio(input_dev *dev) {
+  char path[64];
+  char value[8];
+  char c;
+  int i;
+
+  input_reset(dev);
+  dev->fake = 0;
+
+  for(i=0;i<INPUT_BUTTONS;i++) {
+    // Exporting an already exported pin fails with EBUSY, which is fine
+    snprintf(value,sizeof(value),"%d",gpios[i]);
+    if(write_sysfs("/sys/class/gpio/export",value)<0 && errno!=EBUSY) {
+      input_close(dev);
+      return -1;
+    }
+
+    snprintf(path,sizeof(path),"/sys/class/gpio/gpio%d/edge",gpios[i]);
+    if(write_sysfs(path,"both")<0) {
+      input_close(dev);
+      return -1;
+    }
+
+    snprintf(path,sizeof(path),"/sys/class/gpio/gpio%d/value",gpios[i]);
+    dev->fds[i] = open(path,O_RDONLY);
+    if(dev->fds[i]<0) {
+      input_close(dev);
+      return -1;
+    }
+
+    // Reading clears the edge that is pending from the export
+    if(read(dev->fds[i],&c,1)<0) {
+      input_close(dev);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int input_open_fake(input_dev *dev, const char *dir) {
+  char path[4096];
+  int i;
+
+  input_reset(dev);
+  dev->fake = 1;
+
+  for(i=0;i<INPUT_BUTTONS;i++) {
+    snprintf(path,sizeof(path),"%s/%s",dir,fake_names[i]);
+    if(mkfifo(path,0666)<0 && errno!=EEXIST) {
+      input_close(dev);
+      return -1;
+    }
+
+    // Opening read-write keeps a writer on the pipe, so poll doesn't report
+    // a hangup every time a test or script closes its end.
+    dev->fds[i] = open(path,O_RDWR|O_NONBLOCK);
+    if(dev->fds[i]<0) {
+      input_close(dev);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int input_wait(input_dev *dev, long timeout) {
+  struct pollfd pfd[INPUT_BUTTONS];
+  struct timespec ts;
+  char values[64];
+  ssize_t len;
+  int ret;
+  int i, k;
+  int pressed=0;
+
+  for(i=0;i<INPUT_BUTTONS;i++) {
+    pfd[i].fd = dev->fds[i];
+    // sysfs signals a GPIO edge as an exceptional condition
+    pfd[i].events = dev->fake ? POLLIN : POLLPRI|POLLERR;
+    pfd[i].revents = 0;
+  }
+
+  if(timeout>=0) {
+    ts.tv_sec = timeout/1000000L;
+    ts.tv_nsec = (timeout%1000000L)*1000L;
+  }
+
+  ret = ppoll(pfd,INPUT_BUTTONS,timeout>=0 ? &ts : NULL,NULL);
+  if(ret<0) {
+    return errno==EINTR ? 0 : -1;
+  }
+  if(ret==0) {
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC,&dev->last_event);
+
+  for(i=0;i<INPUT_BUTTONS;i++) {
+    if(pfd[i].revents==0) {
+      continue;
+    }
+
+    if(dev->fake) {
+      // Every byte in the pipe is a state change, so a quick press and
+      // release between two waits still counts.
+      while((len=read(dev->fds[i],values,sizeof(values)))>0) {
+        for(k=0;k<len;k++) {
+          pressed |= update_button(dev,i,values[k]);
+        }
+      }
+    }
+    else {
+      lseek(dev->fds[i],0,SEEK_SET);
+      if(read(dev->fds[i],values,1)>0) {
+        pressed |= update_button(dev,i,values[0]);
+      }
+    }
+  }
+
+  return pressed;
+}
+
+void input_close(input_dev *dev) {
+  int i;
+
+  for(i=0;i<INPUT_BUTTONS;i++) {
+    if(dev->fds[i]>=0) {
+      close(dev->fds[i]);
+      dev->fds[i] = -1;
+    }
+  }
+}
+
+static void input_reset(input_dev *dev) {
+  int i;
+
+  for(i=0;i<INPUT_BUTTONS;i++) {
+    dev->fds[i] = -1;
+    dev->held[i] = 0;
+  }
+  dev->last_event.tv_sec = 0;
+  dev->last_event.tv_nsec = 0;
+}
+
+static int write_sysfs(const char *path, const char *value) {
+  int fd;
+  ssize_t ret;
+
+  fd = open(path,O_WRONLY);
+  if(fd<0) {
+    return -1;
+  }
+
+  ret = write(fd,value,strlen(value));
+  close(fd);
+
+  return ret<0 ? -1 : 0;
+}
+
+static int update_button(input_dev *dev, int button, char value) {
+  if(value=='1' && !dev->held[button]) {
+    dev->held[button] = 1;
+    return 1<<button;
+  }
+  else if(value=='0') {
+    dev->held[button] = 0;
+  }
+
+  return 0;
+}
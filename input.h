@@ -0,0 +1,52 @@
+#ifndef _INPUT_H
+#define _INPUT_H
+#include <time.h>
+
+/*****************************************************************************
+ * Button input for the game. Each button is a file whose contents are '1'
+ * while the button is held and '0' when it is released. Rather than reading
+ * every button on every pass, input_wait sleeps in ppoll until a button
+ * changes or the timeout expires.
+ *
+ * input_open_gpio:
+ * Exports the controller GPIOs through sysfs, sets them to interrupt on both
+ * edges and opens their value files. Returns <0 on error.
+ *
+ * input_open_fake:
+ * Opens a directory of named pipes (rotr, rotl, left, right and down),
+ * creating any that are missing. Writing '1' or '0' into a pipe presses or
+ * releases that button, so the game and tests can run without a board.
+ * Returns <0 on error.
+ *
+ * input_wait:
+ * Waits up to timeout microseconds (forever if negative) for input and
+ * returns a mask of the buttons that were pressed since the last call. A
+ * button has to be released before it registers again. Returns 0 on timeout
+ * or when interrupted by a signal and <0 on error. The monotonic time at
+ * which the last change was seen is kept in last_event.
+ *
+ * input_close:
+ * Closes all of the button files.
+ * **************************************************************************/
+
+#define ROTR (1<<0)
+#define ROTL (1<<1)
+#define LEFT (1<<2)
+#define RIGHT (1<<3)
+#define DOWN (1<<4)
+
+#define INPUT_BUTTONS 5
+
+typedef struct _input_dev {
+  int fake; /* nonzero if reading from named pipes */
+  int fds[INPUT_BUTTONS];
+  int held[INPUT_BUTTONS]; /* button is down and has already been reported */
+  struct timespec last_event;
+} input_dev;
+
+int input_open_gpio(input_dev *dev);
+int input_open_fake(input_dev *dev, const char *dir);
+int input_wait(input_dev *dev, long timeout);
+void input_close(input_dev *dev);
+
+#endif /*!_INPUT_H*/
@@ -0,0 +1,97 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include "input.h"
+
+/* Drives the fake input backend through its named pipes and checks that
+ * presses are reported once per press. */
+
+static const char *names[INPUT_BUTTONS] = { "rotr", "rotl", "left", "right", "down" };
+
+static int failures = 0;
+
+void press(const char *dir, int button, const char *values);
+void expect(const char *what, int got, int wanted);
+
+int main(int argc, char *argv[]) {
+  char dir[] = "/tmp/inputtestXXXXXX";
+  char path[64];
+  input_dev dev;
+  struct timespec before, after;
+  double waited;
+  int i;
+
+  if(mkdtemp(dir)==NULL) {
+    fprintf(stderr,"Unable to create %s\n",dir);
+    exit(1);
+  }
+
+  if(input_open_fake(&dev,dir)<0) {
+    fprintf(stderr,"Unable to open fake inputs in %s\n",dir);
+    exit(1);
+  }
+
+  press(dir,0,"1");
+  expect("Press rotr",input_wait(&dev,100000),ROTR);
+
+  press(dir,0,"1");
+  expect("Rotr still held",input_wait(&dev,0),0);
+
+  press(dir,0,"0");
+  press(dir,2,"1");
+  expect("Release rotr, press left",input_wait(&dev,100000),LEFT);
+
+  press(dir,4,"010");
+  expect("Tap down between waits",input_wait(&dev,100000),DOWN);
+
+  press(dir,3,"1");
+  press(dir,1,"1");
+  expect("Press right and rotl",input_wait(&dev,100000),RIGHT|ROTL);
+
+  clock_gettime(CLOCK_MONOTONIC,&before);
+  expect("Timeout with no input",input_wait(&dev,20000),0);
+  clock_gettime(CLOCK_MONOTONIC,&after);
+  waited = (double)(after.tv_sec-before.tv_sec)*1e6+(double)(after.tv_nsec-before.tv_nsec)/1e3;
+  printf("Waited %.0f microseconds (should be about 20000)\n",waited);
+  if(waited<15000.0) {
+    failures++;
+  }
+
+  input_close(&dev);
+
+  for(i=0;i<INPUT_BUTTONS;i++) {
+    snprintf(path,sizeof(path),"%s/%s",dir,names[i]);
+    unlink(path);
+  }
+  rmdir(dir);
+
+  if(failures>0) {
+    printf("%d failures\n",failures);
+    return 1;
+  }
+  printf("All input tests passed\n");
+  return 0;
+}
+
+void press(const char *dir, int button, const char *values) {
+  char path[64];
+  int fd;
+
+  snprintf(path,sizeof(path),"%s/%s",dir,names[button]);
+  fd = open(path,O_WRONLY|O_NONBLOCK);
+  if(fd<0 || write(fd,values,strlen(values))<0) {
+    fprintf(stderr,"Unable to write %s\n",path);
+    exit(1);
+  }
+  close(fd);
+}
+
+void expect(const char *what, int got, int wanted) {
+  printf("%s: %#x (should be %#x)\n",what,got,wanted);
+  if(got!=wanted) {
+    failures++;
+  }
+}
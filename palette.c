@@ -0,0 +1,34 @@
+#include "palette.h"
+
+void palette_init(tcl_palette *pal) {
+  int i;
+
+  pal->ncolors = 0;
+  for(i=0;i<PALETTE_SIZE;i++) {
+    write_color(&pal->colors[i],0x00,0x00,0x00);
+  }
+}
+
+int palette_set(tcl_palette *pal, int index, uint8_t red, uint8_t green, uint8_t blue) {
+  if(index<0 || index>=PALETTE_SIZE) {
+    return -1;
+  }
+
+  write_color(&pal->colors[index],red,green,blue);
+  if(index>=pal->ncolors) {
+    pal->ncolors = index+1;
+  }
+
+  return 0;
+}
+
+void palette_render(const tcl_palette *pal, const uint8_t *restrict cells, const int *restrict map, tcl_color *restrict out, int n) {
+  const tcl_color *colors = pal->colors;
+  int i;
+
+  // Written as a plain gather so the compiler can vectorize it where the
+  // target has gather loads.
+  for(i=0;i<n;i++) {
+    out[i] = colors[cells[map[i]]];
+  }
+}
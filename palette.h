@@ -0,0 +1,35 @@
+#ifndef _PALETTE_H
+#define _PALETTE_H
+#include <stdint.h>
+#include "tclled.h"
+
+/*****************************************************************************
+ * A palette maps small color indices to pre-encoded tcl_color frames. Grids
+ * store one index byte per cell and rendering is a straight gather through
+ * a flat array that fits in a couple of cache lines, so no hashing or
+ * comparison is done per LED.
+ *
+ * palette_init:
+ * Sets every entry of the palette to black.
+ *
+ * palette_set:
+ * Encodes the given color into entry index. Returns <0 if the index is out
+ * of range.
+ *
+ * palette_render:
+ * Writes n LEDs into out. LED i takes the color of cells[map[i]], so map
+ * selects which cell each LED shows and must only hold valid cell indices.
+ * **************************************************************************/
+
+#define PALETTE_SIZE 16
+
+typedef struct _tcl_palette {
+  int ncolors;
+  tcl_color colors[PALETTE_SIZE];
+} tcl_palette;
+
+void palette_init(tcl_palette *pal);
+int palette_set(tcl_palette *pal, int index, uint8_t red, uint8_t green, uint8_t blue);
+void palette_render(const tcl_palette *pal, const uint8_t *cells, const int *map, tcl_color *out, int n);
+
+#endif /*!_PALETTE_H*/
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tclled.h"
+#include "palette.h"
+#include "hashtable.h"
+
+/* Compares rendering a frame through the palette gather against the
+ * hashtable lookup per LED that tetris used before, with the key hashed on
+ * every lookup, with the hash of each color key worked out up front and
+ * with a DECLARE_HASHTABLE table of char to tcl_color. */
+
+static const int leds = 1250;
+static const int cells = 301;
+static const int frames = 20000;
+static const char color_keys[] = "xcboygpr";
+
+DECLARE_HASHTABLE(colormap, char, tcl_color, hashtable_mix64, hashtable_eq_scalar)
+
+double seconds_since(struct timespec *start);
+
+int main(int argc, char *argv[]) {
+  tcl_palette palette;
+  hashtable *colortable;
+  colormap typed;
+  tcl_buffer buf;
+  uint8_t *index_cells;
+  char *char_cells;
+  int *map;
+  int ncolors;
+  int i, f;
+  tcl_color *source;
+  tcl_color *p;
+  struct timespec start;
+  uint64_t key_hashes[256];
+  double hash_time, prehashed_time, typed_time, palette_time;
+
+  ncolors = strlen(color_keys);
+
+  palette_init(&palette);
+  colortable = hashtable_create(16,NULL);
+  if(!colortable || colormap_init(&typed,16)<0) {
+    fprintf(stderr,"Table allocation error\n");
+    exit(1);
+  }
+  for(i=0;i<ncolors;i++) {
+    palette_set(&palette,i,(uint8_t)(i*32),(uint8_t)(255-i*32),(uint8_t)(i*16));
+    hashtable_insert(colortable,(void*)&color_keys[i],sizeof(char),&palette.colors[i],sizeof(tcl_color));
+    key_hashes[(uint8_t)color_keys[i]] = hashtable_hash(colortable,(void*)&color_keys[i],sizeof(char));
+    colormap_insert(&typed,color_keys[i],palette.colors[i]);
+  }
+
+  index_cells = (uint8_t*)malloc(cells*sizeof(uint8_t));
+  char_cells = (char*)malloc(cells*sizeof(char));
+  map = (int*)malloc(leds*sizeof(int));
+  if(!index_cells || !char_cells || !map) {
+    fprintf(stderr,"Memory error\n");
+    exit(1);
+  }
+
+  srand(1);
+  for(i=0;i<cells;i++) {
+    index_cells[i] = rand()%ncolors;
+    char_cells[i] = color_keys[index_cells[i]];
+  }
+  for(i=0;i<leds;i++) {
+    map[i] = rand()%cells;
+  }
+
+  tcl_init(&buf,leds);
+
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  for(f=0;f<frames;f++) {
+    p = buf.pixels;
+    for(i=0;i<leds;i++) {
+      source = hashtable_get(colortable,&char_cells[map[i]],sizeof(char));
+      memcpy(p,source,sizeof(tcl_color));
+      p++;
+    }
+  }
+  hash_time = seconds_since(&start);
+
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  for(f=0;f<frames;f++) {
+    p = buf.pixels;
+    for(i=0;i<leds;i++) {
+      source = hashtable_get_prehashed(colortable,&char_cells[map[i]],sizeof(char),key_hashes[(uint8_t)char_cells[map[i]]]);
+      memcpy(p,source,sizeof(tcl_color));
+      p++;
+    }
+  }
+  prehashed_time = seconds_since(&start);
+
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  for(f=0;f<frames;f++) {
+    p = buf.pixels;
+    for(i=0;i<leds;i++) {
+      *p++ = *colormap_get(&typed,char_cells[map[i]]);
+    }
+  }
+  typed_time = seconds_since(&start);
+
+  // The typed table must produce the same frame as the palette
+  for(i=0;i<leds;i++) {
+    if(memcmp(&buf.pixels[i],&palette.colors[index_cells[map[i]]],sizeof(tcl_color))!=0) {
+      fprintf(stderr,"Typed table mismatch at LED %d\n",i);
+      exit(1);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  for(f=0;f<frames;f++) {
+    palette_render(&palette,index_cells,map,buf.pixels,leds);
+  }
+  palette_time = seconds_since(&start);
+
+  // Both paths must produce the same frame
+  for(i=0;i<leds;i++) {
+    if(memcmp(&buf.pixels[i],hashtable_get(colortable,&char_cells[map[i]],sizeof(char)),sizeof(tcl_color))!=0) {
+      fprintf(stderr,"Mismatch at LED %d\n",i);
+      exit(1);
+    }
+  }
+
+  printf("%d frames of %d LEDs\n",frames,leds);
+  printf("hashtable: %.1f ns/frame\n",hash_time*1e9/frames);
+  printf("prehashed: %.1f ns/frame\n",prehashed_time*1e9/frames);
+  printf("typed:     %.1f ns/frame\n",typed_time*1e9/frames);
+  printf("palette:   %.1f ns/frame\n",palette_time*1e9/frames);
+  printf("speedup:   %.1fx\n",hash_time/palette_time);
+
+  tcl_free(&buf);
+  hashtable_free(colortable);
+  colormap_free(&typed);
+  free(index_cells);
+  free(char_cells);
+  free(map);
+  return 0;
+}
+
+double seconds_since(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (double)(now.tv_sec-start->tv_sec)+(double)(now.tv_nsec-start->tv_nsec)/1e9;
+}
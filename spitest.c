@@ -0,0 +1,161 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tclled.h"
+
+/* Checks how tcl_spi_send splits frames into SPI messages, using a
+ * transfer function that records what would have gone to the driver, and
+ * that it falls back to write() when the device takes no SPI ioctls. */
+
+static const int leds = 1250;
+
+struct recording {
+  int messages;
+  int segments;
+  size_t largest_message;
+  uint8_t data[8192];
+  size_t size;
+  int fail_with; /* errno to fail with, or 0 */
+};
+
+static int failures = 0;
+
+int record_transfer(tcl_spi *spi, struct spi_ioc_transfer *xfers, unsigned int n);
+void check_split(tcl_spi *spi, tcl_buffer *buf, size_t max_message, size_t max_segment, int messages);
+void check_frame(const char *what, tcl_buffer *buf, const uint8_t *data, size_t size);
+void expect(const char *what, long got, long wanted);
+
+int main(int argc, char *argv[]) {
+  tcl_buffer buf;
+  tcl_spi spi;
+  struct recording rec;
+  int pipefd[2];
+  uint8_t *readback;
+  ssize_t len;
+  size_t total;
+  int i;
+
+  tcl_init(&buf,leds);
+  for(i=0;i<leds;i++) {
+    write_color(&buf.pixels[i],i%256,(i/2)%256,(i/3)%256);
+  }
+
+  readback = (uint8_t *)malloc(buf.size);
+  if(readback==NULL || pipe(pipefd)<0) {
+    fprintf(stderr,"Setup error\n");
+    exit(1);
+  }
+
+  // A pipe is not an SPI device, so frames should simply be written
+  if(tcl_spi_init(&spi,pipefd[1])<0) {
+    fprintf(stderr,"tcl_spi_init failed: %s\n",strerror(errno));
+    exit(1);
+  }
+  expect("Pipe uses write mode",spi.mode,TCL_XFER_WRITE);
+  expect("Write mode sends whole frame",tcl_spi_send(&spi,&buf),buf.size);
+  for(total=0;total<buf.size;total+=len) {
+    len = read(pipefd[0],readback+total,buf.size-total);
+    if(len<=0) break;
+  }
+  check_frame("Write mode",&buf,readback,total);
+
+  // Record the messages that would go to spidev
+  spi.mode = TCL_XFER_MESSAGE;
+  spi.transfer = record_transfer;
+  spi.user = &rec;
+
+  printf("Frame of %lu bytes\n",(unsigned long)buf.size);
+  check_split(&spi,&buf,8192,8192,1);
+  check_split(&spi,&buf,8192,1024,1);
+  check_split(&spi,&buf,4096,4096,2);
+  check_split(&spi,&buf,4096,1000,2);
+  check_split(&spi,&buf,1000,4096,6);
+
+  // A driver that rejects the ioctl switches to writes for good
+  memset(&rec,0,sizeof(rec));
+  rec.fail_with = ENOTTY;
+  spi.max_message = 8192;
+  spi.max_segment = 8192;
+  expect("Fallback sends whole frame",tcl_spi_send(&spi,&buf),buf.size);
+  expect("Fallback switches to write mode",spi.mode,TCL_XFER_WRITE);
+  for(total=0;total<buf.size;total+=len) {
+    len = read(pipefd[0],readback+total,buf.size-total);
+    if(len<=0) break;
+  }
+  check_frame("Fallback",&buf,readback,total);
+
+  close(pipefd[0]);
+  close(pipefd[1]);
+  free(readback);
+  tcl_free(&buf);
+
+  if(failures>0) {
+    printf("%d failures\n",failures);
+    return 1;
+  }
+  printf("All SPI tests passed\n");
+  return 0;
+}
+
+int record_transfer(tcl_spi *spi, struct spi_ioc_transfer *xfers, unsigned int n) {
+  struct recording *rec = (struct recording *)spi->user;
+  size_t message = 0;
+  unsigned int i;
+
+  if(rec->fail_with) {
+    errno = rec->fail_with;
+    return -1;
+  }
+
+  for(i=0;i<n;i++) {
+    if(xfers[i].len>spi->max_segment) {
+      fprintf(stderr,"Segment of %u bytes exceeds %lu\n",xfers[i].len,(unsigned long)spi->max_segment);
+      failures++;
+    }
+    memcpy(rec->data+rec->size,(const void *)(unsigned long)xfers[i].tx_buf,xfers[i].len);
+    rec->size += xfers[i].len;
+    message += xfers[i].len;
+  }
+
+  rec->messages++;
+  rec->segments += n;
+  if(message>rec->largest_message) {
+    rec->largest_message = message;
+  }
+
+  return (int)message;
+}
+
+void check_split(tcl_spi *spi, tcl_buffer *buf, size_t max_message, size_t max_segment, int messages) {
+  struct recording *rec = (struct recording *)spi->user;
+  char what[80];
+
+  memset(rec,0,sizeof(struct recording));
+  spi->max_message = max_message;
+  spi->max_segment = max_segment;
+
+  snprintf(what,sizeof(what),"Message %lu, segment %lu",(unsigned long)max_message,(unsigned long)max_segment);
+  tcl_spi_send(spi,buf);
+  printf("%s: %d messages of %d segments, largest %lu bytes\n",what,rec->messages,rec->segments,(unsigned long)rec->largest_message);
+  expect(what,rec->messages,messages);
+  if(rec->largest_message>max_message) {
+    failures++;
+  }
+  check_frame(what,buf,rec->data,rec->size);
+}
+
+void check_frame(const char *what, tcl_buffer *buf, const uint8_t *data, size_t size) {
+  if(size!=buf->size || memcmp(data,buf->buffer,size)!=0) {
+    printf("%s: frame was not sent intact\n",what);
+    failures++;
+  }
+}
+
+void expect(const char *what, long got, long wanted) {
+  printf("%s: %ld (should be %ld)\n",what,got,wanted);
+  if(got!=wanted) {
+    failures++;
+  }
+}
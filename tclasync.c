@@ -0,0 +1,143 @@
+#include "tclasync.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static void *output_thread(void *arg);
+static unsigned long elapsed_us(struct timespec *start, struct timespec *end);
+
+int tcl_async_start(tcl_async *out, tcl_sink *sink, int leds) {
+  int i;
+
+  out->sink = sink;
+  out->pending = -1;
+  out->sending = -1;
+  out->running = 1;
+  out->error = 0;
+  memset(&out->stats,0,sizeof(tcl_async_stats));
+
+  for(i=0;i<TCL_ASYNC_SLOTS;i++) {
+    tcl_init(&out->slots[i],leds);
+  }
+
+  if(pthread_mutex_init(&out->lock,NULL)!=0) {
+    return -1;
+  }
+  if(pthread_cond_init(&out->ready,NULL)!=0) {
+    pthread_mutex_destroy(&out->lock);
+    return -1;
+  }
+  if(pthread_create(&out->thread,NULL,output_thread,out)!=0) {
+    pthread_cond_destroy(&out->ready);
+    pthread_mutex_destroy(&out->lock);
+    return -1;
+  }
+
+  return 0;
+}
+
+int tcl_async_publish(tcl_async *out, tcl_buffer *frame) {
+  int slot;
+
+  if(frame->size!=out->slots[0].size) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&out->lock);
+  if(out->error) {
+    errno = out->error;
+    pthread_mutex_unlock(&out->lock);
+    return -1;
+  }
+  // With one frame waiting and one being sent there is always a third
+  // slot free, and only the publisher ever fills it.
+  for(slot=0;slot==out->pending || slot==out->sending;slot++);
+  pthread_mutex_unlock(&out->lock);
+
+  memcpy(out->slots[slot].buffer,frame->buffer,frame->size);
+
+  pthread_mutex_lock(&out->lock);
+  if(out->pending>=0) {
+    out->stats.dropped++;
+  }
+  out->pending = slot;
+  out->stats.published++;
+  pthread_cond_signal(&out->ready);
+  pthread_mutex_unlock(&out->lock);
+
+  return 0;
+}
+
+void tcl_async_get_stats(tcl_async *out, tcl_async_stats *stats) {
+  pthread_mutex_lock(&out->lock);
+  *stats = out->stats;
+  stats->queue_depth = (out->pending>=0) ? 1 : 0;
+  pthread_mutex_unlock(&out->lock);
+}
+
+void tcl_async_stop(tcl_async *out) {
+  int i;
+
+  pthread_mutex_lock(&out->lock);
+  out->running = 0;
+  pthread_cond_signal(&out->ready);
+  pthread_mutex_unlock(&out->lock);
+
+  pthread_join(out->thread,NULL);
+  pthread_cond_destroy(&out->ready);
+  pthread_mutex_destroy(&out->lock);
+
+  for(i=0;i<TCL_ASYNC_SLOTS;i++) {
+    tcl_free(&out->slots[i]);
+  }
+}
+
+static void *output_thread(void *arg) {
+  tcl_async *out = (tcl_async *)arg;
+  struct timespec start, end;
+  unsigned long latency;
+  int ret;
+
+  pthread_mutex_lock(&out->lock);
+  while(1) {
+    while(out->running && out->pending<0) {
+      pthread_cond_wait(&out->ready,&out->lock);
+    }
+    if(out->pending<0) {
+      break;
+    }
+
+    out->sending = out->pending;
+    out->pending = -1;
+    pthread_mutex_unlock(&out->lock);
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    ret = tcl_sink_send(out->sink,&out->slots[out->sending]);
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    latency = elapsed_us(&start,&end);
+
+    pthread_mutex_lock(&out->lock);
+    if(ret<0) {
+      out->error = errno;
+    }
+    else {
+      out->stats.sent++;
+      out->stats.last_latency = latency;
+      out->stats.total_latency += latency;
+      if(out->stats.sent==1 || latency<out->stats.min_latency) {
+        out->stats.min_latency = latency;
+      }
+      if(latency>out->stats.max_latency) {
+        out->stats.max_latency = latency;
+      }
+    }
+    out->sending = -1;
+  }
+  pthread_mutex_unlock(&out->lock);
+
+  return NULL;
+}
+
+static unsigned long elapsed_us(struct timespec *start, struct timespec *end) {
+  return (unsigned long)((end->tv_sec-start->tv_sec)*1000000L+(end->tv_nsec-start->tv_nsec)/1000L);
+}
@@ -0,0 +1,60 @@
+#ifndef _TCLASYNC_H
+#define _TCLASYNC_H
+#include <pthread.h>
+#include "tclled.h"
+
+/*****************************************************************************
+ * Sends frames from a background thread so that the caller never waits on
+ * the SPI bus. Frames are copied into one of a few rotating buffers when
+ * published. If a newer frame is published before the output thread got
+ * to the previous one, the older frame is dropped, so the LEDs always show
+ * the most recent frame and the game never queues up behind the bus.
+ *
+ * tcl_async_start:
+ * Allocates buffers for frames of leds LEDs and starts the output thread,
+ * which sends everything to sink from then on. Returns <0 on error.
+ *
+ * tcl_async_publish:
+ * Copies frame into a free buffer and hands it to the output thread.
+ * Returns immediately. Returns <0 if the frame is the wrong size or the
+ * last transfer failed.
+ *
+ * tcl_async_get_stats:
+ * Copies the current statistics. Latencies are in microseconds.
+ *
+ * tcl_async_stop:
+ * Sends any frame still waiting, stops the thread and frees the buffers.
+ * **************************************************************************/
+
+#define TCL_ASYNC_SLOTS 3
+
+typedef struct _tcl_async_stats {
+  unsigned long published; /* frames handed to the output thread */
+  unsigned long sent; /* frames written to the device */
+  unsigned long dropped; /* frames replaced by a newer one before sending */
+  int queue_depth; /* frames waiting to be sent */
+  unsigned long last_latency; /* duration of the most recent transfer */
+  unsigned long min_latency;
+  unsigned long max_latency;
+  unsigned long long total_latency;
+} tcl_async_stats;
+
+typedef struct _tcl_async {
+  tcl_sink *sink;
+  tcl_buffer slots[TCL_ASYNC_SLOTS];
+  int pending; /* slot waiting to be sent, or -1 */
+  int sending; /* slot being sent, or -1 */
+  int running;
+  int error; /* errno of the last failed transfer, or 0 */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  tcl_async_stats stats;
+} tcl_async;
+
+int tcl_async_start(tcl_async *out, tcl_sink *sink, int leds);
+int tcl_async_publish(tcl_async *out, tcl_buffer *frame);
+void tcl_async_get_stats(tcl_async *out, tcl_async_stats *stats);
+void tcl_async_stop(tcl_async *out);
+
+#endif /*!_TCLASYNC_H*/
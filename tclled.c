@@ -3,12 +3,27 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/spi/spidev.h>
 #include <errno.h>
+#include <string.h>
+
+#define SPI_SPEED 15000000
+#define SPIDEV_BUFSIZ "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_DEFAULT_BUFSIZ 4096
+#define MAX_SEGMENTS 64
+/* spidev rounds each transfer up to the DMA alignment when it checks a
+ * message against its buffer size. */
+#define DMA_ALIGN 128
 
 void write_frame(tcl_color *p, uint8_t flag, uint8_t red, uint8_t green, uint8_t blue);
 uint8_t make_flag(uint8_t red, uint8_t greem, uint8_t blue);
 ssize_t write_all(int filedes, const void *buf, size_t size);
+int spi_message_ioctl(tcl_spi *spi, struct spi_ioc_transfer *xfers, unsigned int n);
+size_t spidev_bufsiz();
+int pipe_send(tcl_sink *sink, tcl_buffer *buf);
 
 void tcl_init(tcl_buffer *buf, int leds) {
   buf->leds = leds;
@@ -30,7 +45,7 @@ int spi_init(int filedes) {
   int ret;
   const uint8_t mode = SPI_MODE_0;
   const uint8_t bits = 8;
-  const uint32_t speed = 15000000;
+  const uint32_t speed = SPI_SPEED;
 
   ret = ioctl(filedes,SPI_IOC_WR_MODE, &mode);
   if(ret==-1) {
@@ -64,6 +79,262 @@ int send_buffer(int filedes, tcl_buffer *buf) {
   return ret;
 }
 
+int tcl_spi_init(tcl_spi *spi, int filedes) {
+  spi->filedes = filedes;
+  spi->speed = SPI_SPEED;
+  spi->transfer = spi_message_ioctl;
+  spi->user = NULL;
+  spi->max_message = spidev_bufsiz();
+  spi->max_segment = spi->max_message;
+
+  if(spi_init(filedes)==-1) {
+    // Not an SPI device, so it can only be written to
+    if(errno==ENOTTY || errno==EINVAL) {
+      spi->mode = TCL_XFER_WRITE;
+      return 0;
+    }
+    return -1;
+  }
+
+  spi->mode = TCL_XFER_MESSAGE;
+  return 0;
+}
+
+int tcl_spi_send(tcl_spi *spi, tcl_buffer *buf) {
+  struct spi_ioc_transfer xfers[MAX_SEGMENTS];
+  const uint8_t *p = (const uint8_t *)buf->buffer;
+  size_t remaining = buf->size;
+  size_t used;
+  size_t len;
+  size_t limit;
+  unsigned int n;
+
+  limit = spi->max_message-spi->max_message%DMA_ALIGN;
+
+  while(spi->mode==TCL_XFER_MESSAGE && remaining>0) {
+    // Pack as many segments into this message as the driver will take
+    memset(xfers,0,sizeof(xfers));
+    used = 0;
+    n = 0;
+    while(remaining>0 && n<MAX_SEGMENTS) {
+      len = remaining<spi->max_segment ? remaining : spi->max_segment;
+      if(len>limit-used) {
+        len = limit-used;
+      }
+      if(len<remaining) {
+        // Only the last segment may be a partial alignment block
+        len -= len%DMA_ALIGN;
+      }
+      if(len==0) {
+        break;
+      }
+
+      xfers[n].tx_buf = (unsigned long)p;
+      xfers[n].len = len;
+      xfers[n].speed_hz = spi->speed;
+      xfers[n].bits_per_word = 8;
+      n++;
+      p += len;
+      remaining -= len;
+      used += (len+DMA_ALIGN-1)/DMA_ALIGN*DMA_ALIGN;
+    }
+
+    if(n==0) {
+      // The limits are too small to hold a single segment
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+    if(spi->transfer(spi,xfers,n)<0) {
+      if(errno==EINTR) {
+        p = (const uint8_t *)xfers[0].tx_buf;
+        remaining = buf->size-(p-(const uint8_t *)buf->buffer);
+        continue;
+      }
+      // The driver doesn't take messages, fall back to writing the rest
+      if(errno==ENOTTY || errno==EINVAL) {
+        spi->mode = TCL_XFER_WRITE;
+        p = (const uint8_t *)xfers[0].tx_buf;
+        remaining = buf->size-(p-(const uint8_t *)buf->buffer);
+        break;
+      }
+      return -1;
+    }
+  }
+
+  if(remaining>0) {
+    if(write_all(spi->filedes,p,remaining)<0) {
+      return -1;
+    }
+  }
+
+  return (int)buf->size;
+}
+
+int tcl_sink_open(tcl_sink *sink, const char *spec, size_t frame_size) {
+  const char *path = spec;
+
+  sink->type = TCL_SINK_SPIDEV;
+  sink->filedes = -1;
+  sink->path = NULL;
+  sink->shm = NULL;
+  sink->shm_size = 0;
+
+  if(strncmp(spec,"spidev:",7)==0) {
+    path = spec+7;
+  }
+  else if(strncmp(spec,"file:",5)==0) {
+    sink->type = TCL_SINK_FILE;
+    path = spec+5;
+  }
+  else if(strncmp(spec,"pipe:",5)==0) {
+    sink->type = TCL_SINK_PIPE;
+    path = spec+5;
+  }
+  else if(strncmp(spec,"shm:",4)==0) {
+    sink->type = TCL_SINK_SHM;
+    path = spec+4;
+  }
+  else if(strncmp(spec,"null:",5)==0) {
+    sink->type = TCL_SINK_NULL;
+    return 0;
+  }
+
+  switch(sink->type) {
+    case TCL_SINK_SPIDEV:
+      sink->filedes = open(path,O_WRONLY);
+      if(sink->filedes<0) {
+        return -1;
+      }
+      if(tcl_spi_init(&sink->spi,sink->filedes)<0) {
+        close(sink->filedes);
+        sink->filedes = -1;
+        return -1;
+      }
+      break;
+
+    case TCL_SINK_FILE:
+      sink->filedes = open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+      if(sink->filedes<0) {
+        return -1;
+      }
+      break;
+
+    case TCL_SINK_PIPE:
+      if(mkfifo(path,0666)<0 && errno!=EEXIST) {
+        return -1;
+      }
+      sink->path = strdup(path);
+      if(sink->path==NULL) {
+        return -1;
+      }
+      // A reader going away should drop frames, not kill the process
+      signal(SIGPIPE,SIG_IGN);
+      // Waits here until a reader opens the other end
+      sink->filedes = open(path,O_WRONLY);
+      if(sink->filedes<0) {
+        free(sink->path);
+        sink->path = NULL;
+        return -1;
+      }
+      break;
+
+    case TCL_SINK_SHM:
+      sink->filedes = shm_open(path,O_RDWR|O_CREAT,0666);
+      if(sink->filedes<0) {
+        return -1;
+      }
+      sink->shm_size = sizeof(tcl_shm_header)+frame_size;
+      if(ftruncate(sink->filedes,sink->shm_size)<0) {
+        close(sink->filedes);
+        sink->filedes = -1;
+        return -1;
+      }
+      sink->shm = (tcl_shm_header *)mmap(NULL,sink->shm_size,PROT_READ|PROT_WRITE,MAP_SHARED,sink->filedes,0);
+      if(sink->shm==MAP_FAILED) {
+        sink->shm = NULL;
+        close(sink->filedes);
+        sink->filedes = -1;
+        return -1;
+      }
+      sink->shm->magic = TCL_SHM_MAGIC;
+      sink->shm->size = frame_size;
+      sink->shm->sequence = 0;
+      break;
+  }
+
+  return 0;
+}
+
+int tcl_sink_send(tcl_sink *sink, tcl_buffer *buf) {
+  switch(sink->type) {
+    case TCL_SINK_SPIDEV:
+      return tcl_spi_send(&sink->spi,buf);
+
+    case TCL_SINK_SHM:
+      if(buf->size>sink->shm->size) {
+        errno = EMSGSIZE;
+        return -1;
+      }
+      __atomic_store_n(&sink->shm->sequence,sink->shm->sequence+1,__ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      memcpy(sink->shm+1,buf->buffer,buf->size);
+      __atomic_store_n(&sink->shm->sequence,sink->shm->sequence+1,__ATOMIC_RELEASE);
+      return (int)buf->size;
+
+    case TCL_SINK_NULL:
+      return (int)buf->size;
+
+    case TCL_SINK_PIPE:
+      return pipe_send(sink,buf);
+
+    default:
+      return send_buffer(sink->filedes,buf);
+  }
+}
+
+void tcl_sink_close(tcl_sink *sink) {
+  if(sink->shm) {
+    munmap(sink->shm,sink->shm_size);
+    sink->shm = NULL;
+  }
+  if(sink->filedes>=0) {
+    close(sink->filedes);
+    sink->filedes = -1;
+  }
+  free(sink->path);
+  sink->path = NULL;
+}
+
+/* Sends to a named pipe. Once the reader has gone, frames are discarded
+ * (returning 0) and each send checks, without blocking, whether a new
+ * reader has opened the pipe. */
+int pipe_send(tcl_sink *sink, tcl_buffer *buf) {
+  int flags;
+  int ret;
+
+  if(sink->filedes<0) {
+    sink->filedes = open(sink->path,O_WRONLY|O_NONBLOCK);
+    if(sink->filedes<0) {
+      return errno==ENXIO ? 0 : -1;
+    }
+    flags = fcntl(sink->filedes,F_GETFL);
+    if(flags<0 || fcntl(sink->filedes,F_SETFL,flags&~O_NONBLOCK)<0) {
+      close(sink->filedes);
+      sink->filedes = -1;
+      return -1;
+    }
+  }
+
+  ret = send_buffer(sink->filedes,buf);
+  if(ret<0 && errno==EPIPE) {
+    close(sink->filedes);
+    sink->filedes = -1;
+    return 0;
+  }
+  return ret;
+}
+
 void tcl_free(tcl_buffer *buf) {
   free(buf->buffer);
   buf->buffer=NULL;
@@ -112,4 +383,22 @@ ssize_t write_all(int filedes, const void *buf, size_t size) {
   return buf_len;
 }
 
+int spi_message_ioctl(tcl_spi *spi, struct spi_ioc_transfer *xfers, unsigned int n) {
+  return ioctl(spi->filedes,SPI_IOC_MESSAGE(n),xfers);
+}
+
+size_t spidev_bufsiz() {
+  FILE *fp;
+  unsigned long bufsiz;
 
+  fp = fopen(SPIDEV_BUFSIZ,"r");
+  if(fp==NULL) {
+    return SPIDEV_DEFAULT_BUFSIZ;
+  }
+  if(fscanf(fp,"%lu",&bufsiz)!=1 || bufsiz==0) {
+    bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+  }
+  fclose(fp);
+
+  return (size_t)bufsiz;
+}
@@ -2,6 +2,7 @@
 #define _TCLLED_H
 #include <stdint.h>
 #include <linux/types.h>
+#include <linux/spi/spidev.h>
 #include <stdlib.h>
 
 typedef struct _tcl_color {
@@ -18,10 +19,69 @@ typedef struct _tcl_buffer {
   tcl_color *pixels; /* pointer to start of pixels */
 } tcl_buffer;
 
+/* Transfer modes for tcl_spi */
+#define TCL_XFER_WRITE 0 /* plain write() calls on the device */
+#define TCL_XFER_MESSAGE 1 /* SPI_IOC_MESSAGE ioctls */
+
+/* An SPI connection. tcl_spi_init detects how much the spidev driver takes
+ * in one SPI_IOC_MESSAGE, so a frame goes out in as few ioctls as the driver
+ * allows, one when the frame fits. Each message is made of segments of at
+ * most max_segment bytes. If the device doesn't take SPI ioctls, frames are
+ * written with write() instead. transfer performs one message and can be
+ * replaced, for example to record transfers in tests. */
+typedef struct _tcl_spi {
+  int filedes;
+  int mode;
+  size_t max_message; /* bytes accepted in one SPI_IOC_MESSAGE */
+  size_t max_segment; /* bytes in one spi_ioc_transfer */
+  uint32_t speed;
+  int (*transfer)(struct _tcl_spi *spi, struct spi_ioc_transfer *xfers, unsigned int n);
+  void *user; /* for use by a replacement transfer function */
+} tcl_spi;
+
+/* Output sink types */
+#define TCL_SINK_SPIDEV 0
+#define TCL_SINK_FILE 1
+#define TCL_SINK_PIPE 2
+#define TCL_SINK_SHM 3
+#define TCL_SINK_NULL 4
+
+#define TCL_SHM_MAGIC 0x54434c46 /* "TCLF" */
+
+/* Layout of a shared-memory framebuffer. The frame data follows the
+ * header. sequence is odd while a frame is being copied in, so a reader
+ * that sees the same even value before and after copying has a whole
+ * frame. */
+typedef struct _tcl_shm_header {
+  uint32_t magic;
+  uint32_t size; /* bytes of frame data */
+  uint64_t sequence;
+} tcl_shm_header;
+
+/* Where frames go. tcl_sink_open takes a spec of the form type:path where
+ * type is one of spidev, file (each frame appended to a regular file),
+ * pipe (a named pipe, created if missing), shm (a POSIX shared-memory
+ * framebuffer) or null (frames are discarded, for benchmarks). A spec
+ * without a type is a spidev device. When the reader of a pipe goes away
+ * frames are discarded, without SIGPIPE, until another reader opens it. */
+typedef struct _tcl_sink {
+  int type;
+  int filedes;
+  char *path; /* for reopening a pipe */
+  tcl_spi spi;
+  tcl_shm_header *shm;
+  size_t shm_size;
+} tcl_sink;
+
 void tcl_init(tcl_buffer *buf, int leds);
 int spi_init(int filedes);
 void write_color(tcl_color *p, uint8_t red, uint8_t green, uint8_t blue);
 int send_buffer(int filedes, tcl_buffer *buf);
 void tcl_free(tcl_buffer *buf);
+int tcl_spi_init(tcl_spi *spi, int filedes);
+int tcl_spi_send(tcl_spi *spi, tcl_buffer *buf);
+int tcl_sink_open(tcl_sink *sink, const char *spec, size_t frame_size);
+int tcl_sink_send(tcl_sink *sink, tcl_buffer *buf);
+void tcl_sink_close(tcl_sink *sink);
 
 #endif /*!_TCLLED_H*/
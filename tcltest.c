@@ -1,50 +1,123 @@
 #include <unistd.h>
 #include <stdio.h>
-#include "tclled.h"
+#include <string.h>
 #include <errno.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/time.h>
-#include <sys/types.h>
+#include <time.h>
+#include "tclled.h"
+#include "palette.h"
+#include "grid.h"
+
+/* Times each stage of the render pipeline separately, one sample per frame,
+ * and reports min/median/p99/max. The encode stage writes every LED with
+ * write_color, load_grid maps a grid through the LED map and palette,
+ * combine_grid and copy_grid move a whole grid, and send pushes the buffer
+ * to the sink, which is the null sink unless -o is given. */
 
-static const char *device = "/dev/spidev2.0";
-static const int leds = 1250;
-static const int frames = 10000;
+static const char *default_sink = "null:";
+static const int default_leds = 1250;
+static const int default_frames = 10000;
+static const int strip_leds = 50; // LEDs on each strip of the test wall
+
+#define NSTAGES 5
+static const char *stage_names[NSTAGES] = { "encode", "load_grid", "combine_grid", "copy_grid", "send" };
+
+double now_us();
+int compare_doubles(const void *a, const void *b);
+void report(const char *name, double *samples, int n, int leds, int machine);
+void fill_pattern(struct tetris_grid *grid);
 
 int main(int argc, char *argv[]) {
   tcl_buffer buf;
-  int fd;
+  tcl_sink sink;
+  const char *sink_spec = default_sink;
+  int leds = default_leds;
+  int frames = default_frames;
+  int machine = 0;
+  int opt;
   int ret;
-  int i, j;
+  int i, j, s;
   tcl_color *p;
-  struct timeval tv_start, tv_end, tv_diff;
-  struct timezone tz;
-  double fps;
+  struct wall_geometry geometry;
+  struct tetris_grid current_grid;
+  struct tetris_grid game_grid;
+  struct led_map map;
+  tcl_palette palette;
+  struct tetromino piece = { 1, { -1, 0, 1, 2 }, { 0, 0, 0, 0 } };
+  double *samples[NSTAGES];
+  double start;
 
-  tz.tz_minuteswest=0;
-  tz.tz_dsttime=0;
+  while((opt=getopt(argc,argv,"l:n:o:m"))!=-1) {
+    switch(opt) {
+      case 'l':
+        leds = atoi(optarg);
+        break;
+      case 'n':
+        frames = atoi(optarg);
+        break;
+      case 'o':
+        sink_spec = optarg;
+        break;
+      case 'm':
+        machine = 1;
+        break;
+      default:
+        fprintf(stderr,"Usage: %s [-l leds] [-n frames] [-o sink] [-m]\n",argv[0]);
+        exit(1);
+    }
+  }
+  if(leds<=0 || frames<=0) {
+    fprintf(stderr,"LED and frame counts must be positive.\n");
+    exit(1);
+  }
 
-  ret = gettimeofday(&tv_start,&tz);
-  if(ret==-1) {
-    fprintf(stderr,"Error %d: %s\n",errno, strerror(errno));
+  // Lay the LEDs out as whole strips, like the real wall
+  geometry.rows = strip_leds;
+  geometry.columns = (leds+strip_leds-1)/strip_leds;
+  geometry.start_right = 1;
+  geometry.first_up = 1;
+  geometry.expand = 2;
+  leds = geometry.columns*geometry.rows;
+
+  i = geometry.columns/geometry.expand;
+  if(i<1) i = 1;
+  if(i>32-2*WALL_PAD) i = 32-2*WALL_PAD;
+  make_grid(&current_grid,i,geometry.rows/geometry.expand);
+  make_grid(&game_grid,i,geometry.rows/geometry.expand);
+  if(current_grid.data==NULL || game_grid.data==NULL) {
+    fprintf(stderr,"Memory error: grids\n");
     exit(1);
   }
 
-  fd = open(device,O_WRONLY);
-  if(fd<0) {
-    fprintf(stderr, "Can't open device.\n");
+  // Fill the bottom half of the grid with a pattern of colors
+  palette_init(&palette);
+  for(i=1;i<8;i++) {
+    palette_set(&palette,i,(i&1)*0xff,(i&2)*0x7f,(i&4)*0x3f);
+  }
+  fill_pattern(&current_grid);
+
+  tcl_init(&buf,leds);
+  if(make_led_map(&map,&geometry,&game_grid)<0) {
+    fprintf(stderr,"Memory error: led map\n");
     exit(1);
   }
 
-  ret=spi_init(fd);
+  for(s=0;s<NSTAGES;s++) {
+    samples[s] = (double *)malloc(frames*sizeof(double));
+    if(samples[s]==NULL) {
+      fprintf(stderr,"Memory error: samples\n");
+      exit(1);
+    }
+  }
+
+  ret=tcl_sink_open(&sink,sink_spec,buf.size);
   if(ret==-1) {
-    fprintf(stderr,"error=%d, %s\n", errno, strerror(errno));
+    fprintf(stderr,"Can't open %s: %s\n", sink_spec, strerror(errno));
     exit(1);
   }
 
-  tcl_init(&buf,leds);
-
   for(i=0;i<frames;i++) {
+    // A blue dot moving along the chain
+    start = now_us();
     p = buf.pixels;
     for(j=0;j<leds;j++) {
       if(j==i%leds) {
@@ -55,31 +128,90 @@ int main(int argc, char *argv[]) {
       }
       p++;
     }
-    send_buffer(fd,&buf);
-    /* usleep(1000000); */
-  }
+    samples[0][i] = now_us()-start;
 
-  ret = gettimeofday(&tv_end,&tz);
-  if(ret==-1) {
-    fprintf(stderr,"Error %d: %s\n",errno, strerror(errno));
-    exit(1);
-  }
+    start = now_us();
+    load_grid(&game_grid,&buf,&map,&palette);
+    samples[1][i] = now_us()-start;
 
-  tv_diff.tv_sec=tv_end.tv_sec-tv_start.tv_sec;
-  tv_diff.tv_usec=tv_end.tv_usec-tv_start.tv_usec;
+    start = now_us();
+    // Sweep the piece across the grid, or keep it in column 1 if too narrow
+    combine_grid(&current_grid,&piece,current_grid.nx>2 ? 1+i%(current_grid.nx-2) : 1,current_grid.ny-1,&game_grid);
+    samples[2][i] = now_us()-start;
 
-  while(tv_diff.tv_usec<0) {
-    tv_diff.tv_usec+=1000000;
-    tv_diff.tv_sec-=1;
-  }
+    start = now_us();
+    copy_grid(&game_grid,&current_grid);
+    samples[3][i] = now_us()-start;
 
-  printf("Time elapsed: %d sec and %d microseconds.\n",tv_diff.tv_sec,tv_diff.tv_usec);
+    start = now_us();
+    if(tcl_sink_send(&sink,&buf)<0) {
+      fprintf(stderr,"Send error: %s\n",strerror(errno));
+      exit(1);
+    }
+    samples[4][i] = now_us()-start;
 
-  fps = (double)frames/((double)tv_diff.tv_sec+(double)tv_diff.tv_usec/1000000.0);
+    // Keep the piece from filling up the grid, and put back the pattern
+    // for the next frame's stages to work on
+    clear_grid(&current_grid);
+    fill_pattern(&current_grid);
+  }
 
-  printf("%.2f frames per second.\n",fps);
+  if(machine) {
+    printf("stage\tleds\tframes\tmin_us\tmedian_us\tp99_us\tmax_us\n");
+  }
+  else {
+    printf("%d frames of %d LEDs to %s\n",frames,leds,sink_spec);
+    printf("%-14s %10s %10s %10s %10s\n","stage (us)","min","median","p99","max");
+  }
+  for(s=0;s<NSTAGES;s++) {
+    report(stage_names[s],samples[s],frames,leds,machine);
+    free(samples[s]);
+  }
 
+  tcl_sink_close(&sink);
+  free_led_map(&map);
+  free_grid(&current_grid);
+  free_grid(&game_grid);
   tcl_free(&buf);
-  close(fd);
   return 0;
 }
+
+double now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (double)ts.tv_sec*1e6+(double)ts.tv_nsec/1e3;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+
+  return (da>db)-(da<db);
+}
+
+void report(const char *name, double *samples, int n, int leds, int machine) {
+  double median, p99;
+
+  qsort(samples,n,sizeof(double),compare_doubles);
+  median = samples[(n-1)/2];
+  p99 = samples[(int)(0.99*(n-1)+0.5)];
+
+  if(machine) {
+    printf("%s\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.3f\n",name,leds,n,samples[0],median,p99,samples[n-1]);
+  }
+  else {
+    printf("%-14s %10.3f %10.3f %10.3f %10.3f\n",name,samples[0],median,p99,samples[n-1]);
+  }
+}
+
+/* Fills the bottom half of the grid with a pattern of colors */
+void fill_pattern(struct tetris_grid *grid) {
+  int i, j;
+
+  for(j=0;j<grid->ny/2;j++) {
+    for(i=0;i<grid->nx;i++) {
+      set_point(grid,i,j,(i+j)%8);
+    }
+  }
+}
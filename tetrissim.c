@@ -0,0 +1,242 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "tclled.h"
+#include "palette.h"
+#include "input.h"
+#include "grid.h"
+#include "engine.h"
+#include "hashtable.h"
+
+/* Plays the engine with no board, no buttons and no real clock, as fast as
+ * it will go, and reports steps per second. Each tick advances the virtual
+ * clock by tick_us and calls engine_step once. The buttons come from a
+ * script given with -i, or are random: each tick presses one of them with
+ * the chance given by -p. A script is a file of characters, one per tick,
+ * read over and over: '.' for no button, 'r' and 'l' rotate right and
+ * left, '<' and '>' move left and right and 'v' drops. Whitespace is
+ * skipped. With -r each tick's changed cells are also encoded into a frame
+ * through the LED map of the real wall, as the game does before sending.
+ *
+ * The same seed, script and options always play the same game, and the
+ * hash of the final board printed at the end shows it, so a change to the
+ * engine that should not change the game can be checked against an older
+ * build. */
+
+static const int nx = 12;
+static const int ny = 25;
+static const long default_ticks = 1000000;
+static const unsigned long default_tick_us = 10000; // one frame at 100 fps
+static const int default_press_percent = 20;
+static const uint64_t default_seed = 1;
+
+static const struct wall_geometry wall = { 25, 50, 1, 1, 2 }; // as in tetris.c
+
+static const int buttons[INPUT_BUTTONS] = { ROTR, ROTL, LEFT, RIGHT, DOWN };
+
+double now_us();
+char *read_script(const char *path, long *length);
+int script_input(char c);
+
+int main(int argc, char *argv[]) {
+  struct tetris_engine engine;
+  long ticks = default_ticks;
+  unsigned long tick_us = default_tick_us;
+  int press_percent = default_press_percent;
+  uint64_t seed = default_seed;
+  uint64_t rng;
+  const char *script_path = NULL;
+  char *script = NULL;
+  long script_length = 0;
+  int render = 0;
+  int machine = 0;
+  int opt;
+  int input;
+  long i;
+  unsigned long events[4] = { 0, 0, 0, 0 };
+  int e;
+  tcl_buffer buf;
+  struct led_map map;
+  tcl_palette palette;
+  double start, elapsed;
+
+  while((opt=getopt(argc,argv,"n:s:i:t:p:rm"))!=-1) {
+    switch(opt) {
+      case 'n':
+        ticks = atol(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg,NULL,0);
+        break;
+      case 'i':
+        script_path = optarg;
+        break;
+      case 't':
+        tick_us = strtoul(optarg,NULL,0);
+        break;
+      case 'p':
+        press_percent = atoi(optarg);
+        break;
+      case 'r':
+        render = 1;
+        break;
+      case 'm':
+        machine = 1;
+        break;
+      default:
+        fprintf(stderr,"Usage: %s [-n ticks] [-s seed] [-i script] [-t tick_us] [-p press_percent] [-r] [-m]\n",argv[0]);
+        exit(1);
+    }
+  }
+  if(ticks<=0 || tick_us==0 || press_percent<0 || press_percent>100) {
+    fprintf(stderr,"Ticks and tick length must be positive and the press percentage from 0 to 100.\n");
+    exit(1);
+  }
+
+  if(script_path) {
+    script = read_script(script_path,&script_length);
+    if(script==NULL) {
+      exit(1);
+    }
+  }
+
+  if(engine_init(&engine,nx,ny,seed)<0) {
+    fprintf(stderr,"Memory error: engine\n");
+    exit(1);
+  }
+
+  if(render) {
+    initialize_palette(&palette);
+    if(make_led_map(&map,&wall,&engine.game_grid)<0) {
+      fprintf(stderr,"Memory error: led map\n");
+      exit(1);
+    }
+    tcl_init(&buf,map.leds);
+  }
+
+  // The inputs have their own generator so the pieces don't depend on them
+  rng = seed^UINT64_C(0x5bd1e9955bd1e995);
+
+  start = now_us();
+  for(i=0;i<ticks;i++) {
+    if(script) {
+      input = script_input(script[i%script_length]);
+    }
+    else {
+      rng ^= rng<<13;
+      rng ^= rng>>7;
+      rng ^= rng<<17;
+      input = (int)(rng%100)<press_percent ? buttons[(rng>>32)%INPUT_BUTTONS] : 0;
+    }
+
+    e = engine_step(&engine,input,(uint64_t)(i+1)*tick_us);
+    if(e&ENGINE_DROP) events[0]++;
+    if(e&ENGINE_LAND) events[1]++;
+    if(e&ENGINE_CLEAR) events[2]++;
+    if(e&ENGINE_GAME_OVER) events[3]++;
+
+    if(render && (engine.dirty.full || engine.dirty.n>0)) {
+      load_dirty(&engine.game_grid,&buf,&map,&palette,&engine.dirty);
+    }
+  }
+  elapsed = now_us()-start;
+
+  if(machine) {
+    printf("ticks\ttick_us\tseed\trender\tseconds\tticks_per_s\tns_per_tick\tdrops\tpieces\trows\tgames\tboard\n");
+    printf("%ld\t%lu\t%llu\t%d\t%.3f\t%.0f\t%.1f\t%lu\t%lu\t%lu\t%lu\t%016llx\n",ticks,tick_us,(unsigned long long)seed,render,
+        elapsed/1e6,ticks/(elapsed/1e6),elapsed*1e3/ticks,events[0],engine.pieces_played,engine.rows_cleared,engine.games,
+        (unsigned long long)fnv1a64(engine.game_grid.data,engine.game_grid.nx*engine.game_grid.ny));
+  }
+  else {
+    printf("%ld ticks of %lu us (%.0f s of play)%s, seed %llu, %s inputs\n",ticks,tick_us,ticks*(double)tick_us/1e6,
+        render ? " with rendering" : "",(unsigned long long)seed,script ? script_path : "random");
+    printf("%.3f s: %.0f ticks/s, %.1f ns per tick\n",elapsed/1e6,ticks/(elapsed/1e6),elapsed*1e3/ticks);
+    printf("%lu drops, %lu pieces, %lu rows cleared, %lu games lost, %lu clearing landings\n",
+        events[0],engine.pieces_played,engine.rows_cleared,engine.games,events[2]);
+    printf("board hash %016llx\n",(unsigned long long)fnv1a64(engine.game_grid.data,engine.game_grid.nx*engine.game_grid.ny));
+  }
+
+  if(render) {
+    free_led_map(&map);
+    tcl_free(&buf);
+  }
+  engine_free(&engine);
+  free(script);
+  return 0;
+}
+
+double now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (double)ts.tv_sec*1e6+(double)ts.tv_nsec/1e3;
+}
+
+/* Reads the script, dropping whitespace and checking every character.
+ * Returns NULL after printing the error. */
+char *read_script(const char *path, long *length) {
+  FILE *file;
+  char *script;
+  long size = 0;
+  long n = 0;
+  int c;
+
+  file = fopen(path,"r");
+  if(file==NULL) {
+    fprintf(stderr,"Can't open %s: %s\n",path,strerror(errno));
+    return NULL;
+  }
+
+  script = NULL;
+  while((c=fgetc(file))!=EOF) {
+    if(c==' ' || c=='\t' || c=='\n' || c=='\r') {
+      continue;
+    }
+    if(script_input(c)<0) {
+      fprintf(stderr,"Unknown input '%c' in %s\n",c,path);
+      fclose(file);
+      free(script);
+      return NULL;
+    }
+    if(n==size) {
+      size = size ? size*2 : 256;
+      script = (char *)realloc(script,size);
+      if(script==NULL) {
+        fprintf(stderr,"Memory error: script\n");
+        fclose(file);
+        return NULL;
+      }
+    }
+    script[n++] = c;
+  }
+  fclose(file);
+
+  if(n==0) {
+    fprintf(stderr,"%s holds no inputs\n",path);
+    free(script);
+    return NULL;
+  }
+  *length = n;
+  return script;
+}
+
+int script_input(char c) {
+  switch(c) {
+    case '.':
+      return 0;
+    case 'r':
+      return ROTR;
+    case 'l':
+      return ROTL;
+    case '<':
+      return LEFT;
+    case '>':
+      return RIGHT;
+    case 'v':
+      return DOWN;
+  }
+  return -1;
+}